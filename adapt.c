@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Adaptive keep-warm.  The time between the moment the tunnel
+ * becomes idle and the next connection is recorded:
+ *
+ *  - gaps shorter than the timeout are pauses within a burst of
+ *    connections and are used to shorten the idle timeout to what's
+ *    actually needed to bridge them;
+ *
+ *  - longer ones mark the start of a new burst.  The period between
+ *    bursts is used to extend the idle timeout when the next burst
+ *    is expected soon, and to spawn ssh again shortly before it when
+ *    the tunnel was closed in the meantime.
+ *
+ * Both are tracked as an average and a mean deviation, as TCP does
+ * for the RTT.  The model is saved to a small state file after every
+ * change so that it survives a restart.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lstun.h"
+
+#define MINSAMPLES	4	/* before trusting an estimate */
+#define MINKEEP		5	/* shortest idle timeout */
+#define MINLEAD		5	/* least time to spawn ssh in advance */
+
+void
+estimate_add(struct estimate *e, double x)
+{
+	double d;
+
+	if (e->n++ == 0) {
+		e->avg = x;
+		e->dev = x / 2;
+		return;
+	}
+
+	d = x - e->avg;
+	e->avg += d / 8;
+	e->dev += ((d < 0 ? -d : d) - e->dev) / 4;
+}
+
+static void
+adapt_save(struct adapt *a)
+{
+	char buf[512];
+	int r;
+
+	if (a->statefd == -1)
+		return;
+
+	r = snprintf(buf, sizeof(buf),
+	    "intra %f %f %lld\n"
+	    "period %f %f %lld\n"
+	    "ready %f %f %lld\n"
+	    "lastburst %lld\n",
+	    a->intra.avg, a->intra.dev, a->intra.n,
+	    a->period.avg, a->period.dev, a->period.n,
+	    a->ready.avg, a->ready.dev, a->ready.n,
+	    (long long)a->lastburst);
+	if (r < 0 || (size_t)r >= sizeof(buf))
+		return;
+
+	if (pwrite(a->statefd, buf, r, 0) != r ||
+	    ftruncate(a->statefd, r) == -1)
+		log_warn("can't save the adaptive state");
+}
+
+static void
+adapt_load(struct adapt *a)
+{
+	FILE *fp;
+	struct estimate *e;
+	char line[128], key[16];
+	double avg, dev;
+	long long n;
+
+	if ((fp = fdopen(dup(a->statefd), "r")) == NULL) {
+		log_warn("fdopen");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "lastburst %lld", &n) == 1) {
+			a->lastburst = n;
+			continue;
+		}
+
+		if (sscanf(line, "%15s %lf %lf %lld", key, &avg, &dev,
+		    &n) != 4 || n < 0)
+			continue;
+		if (!strcmp(key, "intra"))
+			e = &a->intra;
+		else if (!strcmp(key, "period"))
+			e = &a->period;
+		else if (!strcmp(key, "ready"))
+			e = &a->ready;
+		else
+			continue;
+		e->avg = avg;
+		e->dev = dev;
+		e->n = n;
+	}
+
+	fclose(fp);
+}
+
+void
+adapt_init(struct adapt *a, const char *path, time_t timeout)
+{
+	memset(a, 0, sizeof(*a));
+	a->statefd = -1;
+	a->maxkeep = timeout;
+	if (path == NULL)
+		return;
+
+	if ((a->statefd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) == -1)
+		fatal("open %s", path);
+	adapt_load(a);
+
+	log_debug("adaptive: intra-burst gap %.0fs (+/- %.0f), period %.0fs"
+	    " (+/- %.0f), ready in %.1fs", a->intra.avg, a->intra.dev,
+	    a->period.avg, a->period.dev, a->ready.avg);
+}
+
+/*
+ * A connection arrived while the tunnel was idle.
+ */
+void
+adapt_arrival(struct adapt *a, time_t now)
+{
+	time_t gap;
+
+	if (a->statefd == -1)
+		return;
+
+	gap = a->idlesince != 0 ? now - a->idlesince : a->maxkeep;
+	a->idlesince = 0;
+
+	if (gap < a->maxkeep)
+		estimate_add(&a->intra, gap);
+	else {
+		if (a->lastburst != 0 && now > a->lastburst)
+			estimate_add(&a->period, now - a->lastburst);
+		a->lastburst = now;
+	}
+
+	adapt_save(a);
+}
+
+/*
+ * ssh took secs to spawn and have the forwarding ready.
+ */
+void
+adapt_ready(struct adapt *a, double secs)
+{
+	if (a->statefd == -1)
+		return;
+
+	estimate_add(&a->ready, secs);
+	adapt_save(a);
+}
+
+/*
+ * The last connection went away.
+ */
+void
+adapt_idle(struct adapt *a, time_t now)
+{
+	a->idlesince = now;
+}
+
+/*
+ * Return how long to keep the idle tunnel open.
+ */
+time_t
+adapt_keep(struct adapt *a, time_t now)
+{
+	time_t keep, next;
+
+	if (a->statefd == -1)
+		return a->maxkeep;
+
+	keep = a->maxkeep;
+	if (a->intra.n >= MINSAMPLES) {
+		keep = a->intra.avg + 4 * a->intra.dev;
+		if (keep < MINKEEP)
+			keep = MINKEEP;
+		if (keep > a->maxkeep)
+			keep = a->maxkeep;
+	}
+
+	/* don't close it if the next burst is about to come */
+	if (a->period.n >= MINSAMPLES) {
+		next = a->lastburst + a->period.avg + 2 * a->period.dev;
+		if (next > now && next - now <= a->maxkeep && next - now > keep)
+			keep = next - now;
+	}
+
+	return keep;
+}
+
+/*
+ * The tunnel was closed: return in how many seconds it should be
+ * spawned again in anticipation of the next burst, or -1 if it's not
+ * known.  *keep is set to how long to keep it open if the burst
+ * doesn't come.
+ */
+time_t
+adapt_prespawn(struct adapt *a, time_t now, time_t *keep)
+{
+	time_t lead, next, p;
+
+	if (a->statefd == -1 || a->period.n < MINSAMPLES || a->period.avg < 1)
+		return -1;
+
+	lead = 2 * (a->ready.avg + a->ready.dev) + a->period.dev;
+	if (lead < MINLEAD)
+		lead = MINLEAD;
+
+	/* bursts may be skipped, aim at the first one in the future */
+	p = a->period.avg;
+	next = a->lastburst + p;
+	if (next - lead <= now)
+		next += ((now + lead - next) / p + 1) * p;
+
+	*keep = 2 * lead;
+	return next - lead - now;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Admission control.  Three limits, all off by default:
+ *
+ *  - the clients connected at the same time: once there are that many
+ *    the workers stop accepting and leave the others in the listen
+ *    queue until one goes away;
+ *
+ *  - the clients accepted per second, as a token bucket that holds
+ *    up to a second worth of them: when it's empty the workers stop
+ *    accepting until the next token;
+ *
+ *  - the clients connected at the same time from one address: those
+ *    over it are accepted and reset right away, so that one host
+ *    can't take all the others' room.
+ *
+ * The first two are checked before accepting, so when the workers
+ * race for the last place a few more may get in: better than turning
+ * away clients that already waited in the queue.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "lstun.h"
+
+#define NORIGINS	1024	/* hash buckets */
+
+struct origin {
+	struct origin		*next;
+	int			 family;
+	unsigned char		 addr[16];
+	int			 conns;
+};
+
+int			 admit_max;		/* clients */
+int			 admit_maxsource;	/* clients per address */
+int			 admit_rate;		/* clients per second */
+
+static pthread_mutex_t	 admit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		 nconns;
+static int		 full;		/* workers stopped on admit_max */
+static double		 tokens;
+static struct timespec	 refilled;
+static struct origin	*origins[NORIGINS];
+
+/*
+ * Refill the bucket for the time elapsed.  Called with admit_lock
+ * held.
+ */
+static void
+refill(void)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (refilled.tv_sec == 0)
+		tokens = admit_rate;
+	else {
+		secs = now.tv_sec - refilled.tv_sec +
+		    (now.tv_nsec - refilled.tv_nsec) / 1000000000.0;
+		tokens += secs * admit_rate;
+		if (tokens > admit_rate)
+			tokens = admit_rate;
+	}
+	refilled = now;
+}
+
+/*
+ * Whether to accept another client.  Returns 0 if so, -1 to wait
+ * until a client goes away, or how many microseconds to wait before
+ * trying again.
+ */
+long
+admit_check(void)
+{
+	long r = 0;
+
+	if (admit_max == 0 && admit_rate == 0)
+		return 0;
+
+	pthread_mutex_lock(&admit_lock);
+	if (admit_max != 0 && nconns >= admit_max) {
+		full = 1;
+		r = -1;
+	} else if (admit_rate != 0) {
+		refill();
+		if (tokens < 1)
+			r = (1 - tokens) * 1000000 / admit_rate + 1;
+	}
+	pthread_mutex_unlock(&admit_lock);
+	return r;
+}
+
+static struct origin **
+origin_lookup(int family, const unsigned char *addr, size_t len)
+{
+	struct origin **sp;
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		h = (h ^ addr[i]) * 16777619U;
+
+	for (sp = &origins[h % NORIGINS]; *sp != NULL; sp = &(*sp)->next)
+		if ((*sp)->family == family &&
+		    !memcmp((*sp)->addr, addr, len))
+			break;
+	return sp;
+}
+
+/*
+ * Count the client coming from sa.  Returns -1 if there are too many
+ * from the same address and it has to be turned away, otherwise 0 and
+ * sets *o to pass to admit_release once it's gone.
+ */
+int
+admit_conn(const struct sockaddr *sa, struct origin **o)
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	const unsigned char *addr = NULL;
+	struct origin **sp;
+	size_t len = 0;
+	int r = -1;
+
+	*o = NULL;
+	if (admit_max == 0 && admit_rate == 0 && admit_maxsource == 0)
+		return 0;
+
+	if (admit_maxsource != 0 && sa->sa_family == AF_INET) {
+		sin = (const struct sockaddr_in *)sa;
+		addr = (const unsigned char *)&sin->sin_addr;
+		len = sizeof(sin->sin_addr);
+	} else if (admit_maxsource != 0 && sa->sa_family == AF_INET6) {
+		sin6 = (const struct sockaddr_in6 *)sa;
+		addr = (const unsigned char *)&sin6->sin6_addr;
+		len = sizeof(sin6->sin6_addr);
+	}
+
+	pthread_mutex_lock(&admit_lock);
+
+	if (addr != NULL) {
+		sp = origin_lookup(sa->sa_family, addr, len);
+		if (*sp == NULL) {
+			if ((*sp = calloc(1, sizeof(**sp))) == NULL)
+				goto done;
+			(*sp)->family = sa->sa_family;
+			memcpy((*sp)->addr, addr, len);
+		}
+		if ((*sp)->conns >= admit_maxsource)
+			goto done;
+		(*sp)->conns++;
+		*o = *sp;
+	}
+
+	if (admit_rate != 0) {
+		refill();
+		tokens--;
+	}
+	nconns++;
+	r = 0;
+
+ done:
+	pthread_mutex_unlock(&admit_lock);
+	return r;
+}
+
+/*
+ * A client admitted by admit_conn went away.  Returns 1 if the
+ * workers stopped on admit_max have to be woken up.
+ */
+int
+admit_release(struct origin *o)
+{
+	struct origin **sp;
+	int wake = 0;
+
+	if (admit_max == 0 && admit_rate == 0 && admit_maxsource == 0)
+		return 0;
+
+	pthread_mutex_lock(&admit_lock);
+
+	nconns--;
+	if (full && nconns < admit_max) {
+		full = 0;
+		wake = 1;
+	}
+
+	if (o != NULL && --o->conns == 0) {
+		sp = origin_lookup(o->family, o->addr, o->family == AF_INET ?
+		    sizeof(struct in_addr) : sizeof(struct in6_addr));
+		*sp = o->next;
+		free(o);
+	}
+
+	pthread_mutex_unlock(&admit_lock);
+	return wake;
+}
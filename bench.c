@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark of lstun, see `make bench'.  It's both the driver and,
+ * when executed as ssh, a stand-in for it: lstun-bench is lstun built
+ * with SSH_PROG pointing here.
+ *
+ * The stand-in binds the -L address and serves the connections
+ * itself: the first byte tells whether to echo (`e') or to discard
+ * (`s') what follows.  LSTBENCH_DELAY is how many milliseconds to
+ * wait before being ready, to pretend there's a handshake.
+ *
+ * The driver runs lstun with each of the backends given and reports:
+ *
+ *  - the latency of the first request, which has to wait for ssh,
+ *    over a few cold starts;
+ *  - how many connections per second it goes through, each sending
+ *    a request and waiting for the echo, and their latency;
+ *  - the throughput of long connections only sending data.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK	(64 * 1024)
+
+struct sconn {
+	struct bufferevent	*bev;
+	int			 fd;
+	int			 mode;
+};
+
+struct samples {
+	double			*v;
+	size_t			 n;
+	size_t			 cap;
+};
+
+struct lstun {
+	pid_t			 pid;
+	FILE			*log;
+	pthread_t		 drainer;
+};
+
+struct worker {
+	pthread_t		 tid;
+	struct samples		 lat;
+	unsigned long long	 bytes;
+};
+
+static const char	*lstun_path = "./lstun-bench";
+static int		 port = 17000;
+static int		 nconns = 16;
+static int		 secs = 5;
+static int		 ncold = 5;
+static size_t		 size = 1024;
+static int		 unixfwd;
+static const char	*nworkers = "1";
+
+static struct timespec	 deadline;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* the stand-in */
+
+static void
+sconn_close(struct bufferevent *bev, short event, void *d)
+{
+	struct sconn *sc = d;
+
+	bufferevent_free(sc->bev);
+	close(sc->fd);
+	free(sc);
+}
+
+static void
+sconn_read(struct bufferevent *bev, void *d)
+{
+	struct sconn *sc = d;
+	struct evbuffer *in = EVBUFFER_INPUT(bev);
+
+	if (sc->mode == 0) {
+		if (EVBUFFER_LENGTH(in) == 0)
+			return;
+		sc->mode = EVBUFFER_DATA(in)[0];
+		evbuffer_drain(in, 1);
+	}
+
+	if (sc->mode == 'e')
+		bufferevent_write_buffer(bev, in);
+	else
+		evbuffer_drain(in, EVBUFFER_LENGTH(in));
+}
+
+static void
+sconn_accept(int fd, short event, void *d)
+{
+	struct sconn *sc;
+	int s;
+
+	if ((s = accept(fd, NULL, NULL)) == -1)
+		return;
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL) {
+		close(s);
+		return;
+	}
+	sc->fd = s;
+	sc->bev = bufferevent_new(s, sconn_read, NULL, sconn_close, sc);
+	if (sc->bev == NULL) {
+		close(s);
+		free(sc);
+		return;
+	}
+	bufferevent_enable(sc->bev, EV_READ|EV_WRITE);
+}
+
+/*
+ * Bind [bind_address:]port or path, ignoring the host:hostport part
+ * of the forwarding.
+ */
+static int
+sbind(char *spec)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_un sun;
+	char *c, *f[4];
+	const char *errstr;
+	int n = 0, s, v = 1;
+
+	while ((c = strsep(&spec, ":")) != NULL && n < 4)
+		f[n++] = c;
+	if (n < 3)
+		errx(1, "wrong forwarding");
+
+	if (*f[0] == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strlcpy(sun.sun_path, f[0], sizeof(sun.sun_path));
+		unlink(f[0]);
+		if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			err(1, "socket");
+		if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			err(1, "bind %s", f[0]);
+	} else {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(strtonum(f[n == 4 ? 1 : 0], 1, 65535,
+		    &errstr));
+		if (errstr != NULL)
+			errx(1, "port is %s", errstr);
+		if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			err(1, "socket");
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &v,
+		    sizeof(v)) == -1)
+			err(1, "setsockopt");
+		if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+			err(1, "bind");
+	}
+
+	if (listen(s, 1024) == -1)
+		err(1, "listen");
+	return s;
+}
+
+static int __dead
+fake_ssh(int argc, char **argv)
+{
+	struct event ev;
+	const char *s;
+	char *spec = NULL;
+	int ch, fd, ready = 0;
+
+	while ((ch = getopt(argc, argv, "L:MNO:S:Tqo:")) != -1) {
+		switch (ch) {
+		case 'L':
+			spec = optarg;
+			break;
+		case 'M':
+		case 'O':
+			errx(1, "control masters are not supported");
+		case 'o':
+			if (!strncmp(optarg, "LocalCommand=", 13))
+				ready = 1;
+			break;
+		default:
+			break;
+		}
+	}
+	if (spec == NULL)
+		errx(1, "only the forwarding is supported");
+
+	if ((s = getenv("LSTBENCH_DELAY")) != NULL)
+		usleep(atoi(s) * 1000);
+
+	fd = sbind(spec);
+	event_init();
+	event_set(&ev, fd, EV_READ|EV_PERSIST, sconn_accept, NULL);
+	event_add(&ev, NULL);
+
+	if (ready)
+		write(STDOUT_FILENO, "\n", 1);
+
+	event_dispatch();
+	exit(0);
+}
+
+/* the driver */
+
+static void
+samples_add(struct samples *s, double v)
+{
+	double *t;
+
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		if ((t = reallocarray(s->v, s->cap, sizeof(*t))) == NULL)
+			err(1, "reallocarray");
+		s->v = t;
+	}
+	s->v[s->n++] = v;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* in milliseconds */
+static double
+quantile(struct samples *s, double q)
+{
+	size_t i;
+
+	if (s->n == 0)
+		return 0;
+	i = q * s->n;
+	if (i >= s->n)
+		i = s->n - 1;
+	return s->v[i] * 1000;
+}
+
+static int
+dial(int p)
+{
+	struct sockaddr_in sin;
+	int s, v = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(p);
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v));
+	if (connect(s, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ * Send a request and wait for the echo.  Returns how long it took, or
+ * -1 on failure.
+ */
+static double
+request(char *buf)
+{
+	double start;
+	size_t off;
+	ssize_t n;
+	int s;
+
+	start = now();
+	if ((s = dial(port)) == -1)
+		return -1;
+
+	buf[0] = 'e';
+	for (off = 0; off < size + 1; off += n)
+		if ((n = write(s, buf + off, size + 1 - off)) <= 0)
+			goto err;
+	for (off = 0; off < size; off += n)
+		if ((n = read(s, buf, size - off)) <= 0)
+			goto err;
+
+	close(s);
+	return now() - start;
+
+err:
+	close(s);
+	return -1;
+}
+
+static int
+expired(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec > deadline.tv_sec || (ts.tv_sec == deadline.tv_sec &&
+	    ts.tv_nsec >= deadline.tv_nsec);
+}
+
+static void *
+connloop(void *arg)
+{
+	struct worker *w = arg;
+	double t;
+	char *buf;
+
+	if ((buf = malloc(size + 1)) == NULL)
+		err(1, "malloc");
+	memset(buf, 'x', size + 1);
+
+	while (!expired())
+		if ((t = request(buf)) != -1)
+			samples_add(&w->lat, t);
+
+	free(buf);
+	return NULL;
+}
+
+static void *
+sinkloop(void *arg)
+{
+	struct worker *w = arg;
+	char *buf;
+	ssize_t n;
+	int s;
+
+	if ((buf = malloc(CHUNK)) == NULL)
+		err(1, "malloc");
+	memset(buf, 'x', CHUNK);
+
+	if ((s = dial(port)) == -1 || write(s, "s", 1) != 1) {
+		warnx("can't connect");
+		goto done;
+	}
+	while (!expired()) {
+		if ((n = write(s, buf, CHUNK)) <= 0)
+			break;
+		w->bytes += n;
+	}
+
+done:
+	if (s != -1)
+		close(s);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Run nconns threads doing fn for secs seconds.
+ */
+static void
+run(void *(*fn)(void *), struct samples *lat, unsigned long long *bytes)
+{
+	struct worker *w;
+	size_t i, j;
+
+	if ((w = calloc(nconns, sizeof(*w))) == NULL)
+		err(1, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += secs;
+
+	for (i = 0; i < nconns; ++i)
+		if ((errno = pthread_create(&w[i].tid, NULL, fn, &w[i])) != 0)
+			err(1, "pthread_create");
+	for (i = 0; i < nconns; ++i) {
+		pthread_join(w[i].tid, NULL);
+		for (j = 0; j < w[i].lat.n; ++j)
+			samples_add(lat, w[i].lat.v[j]);
+		*bytes += w[i].bytes;
+		free(w[i].lat.v);
+	}
+	free(w);
+
+	qsort(lat->v, lat->n, sizeof(*lat->v), cmp);
+}
+
+static void *
+drain(void *arg)
+{
+	struct lstun *l = arg;
+	char line[1024];
+
+	while (fgets(line, sizeof(line), l->log) != NULL)
+		/* discard */;
+	return NULL;
+}
+
+/*
+ * Start lstun with the backend and wait for it to be ready.  Returns
+ * -1 if it failed, the backend is probably not available.
+ */
+static int
+lstun_start(struct lstun *l, const char *backend)
+{
+	char sshaddr[64], addr[64], line[1024];
+	const char *argv[16];
+	int argc = 0, p[2];
+
+	snprintf(sshaddr, sizeof(sshaddr), "%d:127.0.0.1:%d", port + 1,
+	    port + 2);
+	snprintf(addr, sizeof(addr), "127.0.0.1:%d", port);
+
+	argv[argc++] = lstun_path;
+	argv[argc++] = "-d";
+	argv[argc++] = "-j";
+	argv[argc++] = nworkers;
+	argv[argc++] = "-s";
+	argv[argc++] = backend;
+	if (unixfwd)
+		argv[argc++] = "-u";
+	argv[argc++] = "-B";
+	argv[argc++] = sshaddr;
+	argv[argc++] = "-b";
+	argv[argc++] = addr;
+	argv[argc++] = "bench";
+	argv[argc++] = NULL;
+
+	if (pipe(p) == -1)
+		err(1, "pipe");
+
+	switch (l->pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		close(p[0]);
+		if (dup2(p[1], STDERR_FILENO) == -1)
+			err(1, "dup2");
+		execv(lstun_path, (char **)argv);
+		err(1, "exec %s", lstun_path);
+	}
+
+	close(p[1]);
+	if ((l->log = fdopen(p[0], "r")) == NULL)
+		err(1, "fdopen");
+
+	/* it's not listening yet until it says so */
+	while (fgets(line, sizeof(line), l->log) != NULL) {
+		if (strstr(line, "starting") == NULL)
+			continue;
+		if ((errno = pthread_create(&l->drainer, NULL, drain, l)) != 0)
+			err(1, "pthread_create");
+		return 0;
+	}
+
+	fclose(l->log);
+	waitpid(l->pid, NULL, 0);
+	return -1;
+}
+
+static void
+lstun_stop(struct lstun *l)
+{
+	int s;
+
+	kill(l->pid, SIGTERM);
+	waitpid(l->pid, NULL, 0);
+	pthread_join(l->drainer, NULL);
+	fclose(l->log);
+
+	/* wait for the stand-in to go away too */
+	while ((s = dial(port + 1)) != -1) {
+		close(s);
+		usleep(10000);
+	}
+}
+
+static void
+bench(const char *backend)
+{
+	struct lstun l;
+	struct samples cold, lat;
+	unsigned long long bytes = 0;
+	double t;
+	char *buf;
+	int i;
+
+	memset(&cold, 0, sizeof(cold));
+	memset(&lat, 0, sizeof(lat));
+	if ((buf = malloc(size + 1)) == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < ncold; ++i) {
+		if (lstun_start(&l, backend) == -1) {
+			printf("%-10s not available\n", backend);
+			free(buf);
+			return;
+		}
+		if ((t = request(buf)) != -1)
+			samples_add(&cold, t);
+		if (i != ncold - 1)
+			lstun_stop(&l);
+	}
+	qsort(cold.v, cold.n, sizeof(*cold.v), cmp);
+
+	run(connloop, &lat, &bytes);
+	printf("%-10s %9.2f %9.2f %9.0f %8.2f %8.2f %8.2f", backend,
+	    quantile(&cold, .5), quantile(&cold, .99), lat.n / (double)secs,
+	    quantile(&lat, .5), quantile(&lat, .99), quantile(&lat, .999));
+	fflush(stdout);
+
+	free(lat.v);
+	memset(&lat, 0, sizeof(lat));
+	run(sinkloop, &lat, &bytes);
+	printf(" %9.1f\n", bytes / (double)secs / (1024 * 1024));
+
+	lstun_stop(&l);
+	free(lat.v);
+	free(cold.v);
+	free(buf);
+}
+
+static void __dead
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-u] [-c conns] [-j workers] [-k cold]"
+	    " [-l lstun] [-p port]\n\t[-s size] [-t secs] [backend ...]\n",
+	    getprogname());
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *errstr;
+	const char *all[] = { "buffer", "splice", "sosplice", "uring", NULL };
+	int ch, i;
+
+	if (!strcmp(getprogname(), "ssh"))
+		fake_ssh(argc, argv);
+
+	while ((ch = getopt(argc, argv, "c:j:k:l:p:s:t:u")) != -1) {
+		switch (ch) {
+		case 'c':
+			nconns = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "conns is %s: %s", errstr, optarg);
+			break;
+		case 'j':
+			nworkers = optarg;
+			break;
+		case 'k':
+			ncold = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "cold starts is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'l':
+			lstun_path = optarg;
+			break;
+		case 'p':
+			port = strtonum(optarg, 1, 65533, &errstr);
+			if (errstr != NULL)
+				errx(1, "port is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			size = strtonum(optarg, 1, CHUNK, &errstr);
+			if (errstr != NULL)
+				errx(1, "size is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			secs = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(1, "seconds is %s: %s", errstr, optarg);
+			break;
+		case 'u':
+			unixfwd = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%d connections, %zu bytes requests, %ds per test,"
+	    " %d cold starts; latency in ms\n\n", nconns, size, secs, ncold);
+	printf("%-10s %9s %9s %9s %8s %8s %8s %9s\n", "backend", "cold p50",
+	    "cold p99", "conn/s", "p50", "p99", "p999", "MB/s");
+
+	if (argc == 0)
+		for (i = 0; all[i] != NULL; ++i)
+			bench(all[i]);
+	for (i = 0; i < argc; ++i)
+		bench(argv[i]);
+
+	return 0;
+}
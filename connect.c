@@ -0,0 +1,486 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Non-blocking connect to the ssh forwarding.  The addresses are
+ * tried in the spirit of RFC 8305 ("Happy Eyeballs"): the families
+ * are interleaved and a new attempt is started every STAGGER, or
+ * as soon as the previous fails, without waiting for the ones in
+ * flight; the first to complete wins.
+ *
+ * The addresses are resolved once and shared by all the workers until
+ * CACHETTL expires or a connection fails for reasons other than ssh
+ * not listening yet.  The one that worked last is tried first.
+ *
+ * The first lookup is done at startup; the later ones by a thread of
+ * their own, so that a slow DNS doesn't hold up the workers, which
+ * keep using the old addresses in the meantime.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lstun.h"
+
+#define STAGGER		250000	/* connection attempt delay, usec */
+#define RACETIMEOUT	5	/* for the last attempts, seconds */
+#define CACHETTL	60	/* seconds */
+#define RESOLVERETRY	5	/* after a failed lookup, seconds */
+
+/* protects all the struct addrcache and the resolver queue */
+static pthread_mutex_t		 cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 resolve_cond = PTHREAD_COND_INITIALIZER;
+static struct addrcache		*resolve_queue;
+static int			 resolver_running;
+
+static void	attempt_next(struct conn *);
+
+/*
+ * Resolve host:port into addrs and lens.  Returns the number of
+ * addresses, or -1 on failure.  May block.
+ */
+static int
+lookup(const char *host, const char *port, struct sockaddr_storage *addrs,
+    socklen_t *lens)
+{
+	struct addrinfo hints, *res, *res0, *v4, *v6;
+	struct sockaddr_un *sun;
+	int n, r;
+
+	/* a unix-domain socket, see -u */
+	if (*host == '/') {
+		sun = (struct sockaddr_un *)&addrs[0];
+		memset(sun, 0, sizeof(*sun));
+		sun->sun_family = AF_UNIX;
+		if (strlcpy(sun->sun_path, host, sizeof(sun->sun_path)) >=
+		    sizeof(sun->sun_path)) {
+			log_warnx("path too long: %s", host);
+			return -1;
+		}
+		lens[0] = sizeof(*sun);
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	r = getaddrinfo(host, port, &hints, &res0);
+	if (r != 0) {
+		log_warnx("getaddrinfo(\"%s\", \"%s\"): %s", host, port,
+		    gai_strerror(r));
+		return -1;
+	}
+
+	/*
+	 * Interleave the families, starting with the one preferred by
+	 * getaddrinfo, but keep the order within each of them.
+	 */
+	n = 0;
+	v4 = v6 = res0;
+	res = res0;
+	while (n < MAXADDRS && res != NULL) {
+		memcpy(&addrs[n], res->ai_addr, res->ai_addrlen);
+		lens[n++] = res->ai_addrlen;
+
+		if (res->ai_family == AF_INET6)
+			v6 = res->ai_next;
+		else
+			v4 = res->ai_next;
+		while (v6 != NULL && v6->ai_family != AF_INET6)
+			v6 = v6->ai_next;
+		while (v4 != NULL && v4->ai_family == AF_INET6)
+			v4 = v4->ai_next;
+
+		if (res->ai_family == AF_INET6)
+			res = v4 != NULL ? v4 : v6;
+		else
+			res = v6 != NULL ? v6 : v4;
+	}
+
+	freeaddrinfo(res0);
+	return n;
+}
+
+/*
+ * Store the outcome of a lookup in the cache.  Called with cache_lock
+ * held.
+ */
+static void
+cache_update(struct addrcache *ac, int n, struct sockaddr_storage *addrs,
+    socklen_t *lens)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (*ac->host != '/')
+		ac->lookups++;
+
+	/* keep the old addresses, if any, and try again later */
+	if (n == -1) {
+		ac->expire = now.tv_sec + RESOLVERETRY;
+		return;
+	}
+
+	memcpy(ac->addrs, addrs, n * sizeof(*addrs));
+	memcpy(ac->lens, lens, n * sizeof(*lens));
+	ac->n = n;
+	ac->last = -1;
+	ac->gen++;
+	ac->expire = now.tv_sec + CACHETTL;
+}
+
+static void *
+resolver(void *arg)
+{
+	struct addrcache *ac;
+	struct sockaddr_storage addrs[MAXADDRS];
+	socklen_t lens[MAXADDRS];
+	const char *host, *port;
+	int n;
+
+	pthread_mutex_lock(&cache_lock);
+	for (;;) {
+		while ((ac = resolve_queue) == NULL)
+			pthread_cond_wait(&resolve_cond, &cache_lock);
+		resolve_queue = ac->rnext;
+		host = ac->host;
+		port = ac->port;
+		pthread_mutex_unlock(&cache_lock);
+
+		n = lookup(host, port, addrs, lens);
+
+		pthread_mutex_lock(&cache_lock);
+		cache_update(ac, n, addrs, lens);
+		ac->resolving = 0;
+	}
+	return NULL;
+}
+
+/*
+ * Have the resolver thread refresh ac, starting it if needed.  Called
+ * with cache_lock held.
+ */
+static void
+cache_refresh(struct addrcache *ac)
+{
+	pthread_t tid;
+	sigset_t set, oset;
+
+	if (ac->resolving)
+		return;
+
+	if (!resolver_running) {
+		/* signals are handled only by the main thread */
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &oset);
+		errno = pthread_create(&tid, NULL, resolver, NULL);
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+		if (errno != 0) {
+			log_warn("pthread_create");
+			return;
+		}
+		pthread_detach(tid);
+		resolver_running = 1;
+	}
+
+	ac->resolving = 1;
+	ac->rnext = resolve_queue;
+	resolve_queue = ac;
+	pthread_cond_signal(&resolve_cond);
+}
+
+/*
+ * Resolve host:port into ac right away.  Called at startup, before the
+ * workers run.
+ */
+void
+connect_resolve(struct addrcache *ac, const char *host, const char *port)
+{
+	struct sockaddr_storage addrs[MAXADDRS];
+	socklen_t lens[MAXADDRS];
+	int n;
+
+	n = lookup(host, port, addrs, lens);
+
+	pthread_mutex_lock(&cache_lock);
+	ac->host = host;
+	ac->port = port;
+	cache_update(ac, n, addrs, lens);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void
+conn_addr(struct conn *c, int i)
+{
+	memcpy(&c->addrs[c->naddrs], &c->cache->addrs[i], c->cache->lens[i]);
+	c->addrlens[c->naddrs] = c->cache->lens[i];
+	c->cacheidx[c->naddrs] = i;
+	c->naddrs++;
+}
+
+static void
+attempt_close(struct conn *c, int i)
+{
+	event_del(&c->attemptev[i]);
+	close(c->attempts[i]);
+	c->attempts[i] = -1;
+	c->inflight--;
+}
+
+static void
+race_end(struct conn *c, int winner)
+{
+	int i;
+
+	for (i = 0; i < c->nextaddr; ++i)
+		if (i != winner && c->attempts[i] != -1)
+			attempt_close(c, i);
+
+	if (winner != -1) {
+		event_del(&c->attemptev[winner]);
+		c->to = c->attempts[winner];
+		c->attempts[winner] = -1;
+		c->inflight--;
+	}
+
+	if (evtimer_pending(&c->staggerev, NULL))
+		evtimer_del(&c->staggerev);
+	c->connecting = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if (c->cachegen == c->cache->gen) {
+		if (winner != -1)
+			c->cache->last = c->cacheidx[winner];
+		else if (c->connerr != 0 && c->connerr != ECONNREFUSED &&
+		    c->connerr != ENOENT) {
+			/* not only ssh not listening yet, re-resolve */
+			c->cache->expire = 0;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void
+attempt_done(int fd, short ev, void *d)
+{
+	struct conn *c = d;
+	socklen_t len;
+	int i, err;
+
+	for (i = 0; i < c->nextaddr; ++i)
+		if (c->attempts[i] == fd)
+			break;
+
+	len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+
+	if (err == 0) {
+		race_end(c, i);
+		conn_connected(c, 0);
+		return;
+	}
+
+	log_debug("connect: %s", strerror(err));
+	c->connerr = err;
+	attempt_close(c, i);
+
+	/* don't wait for the stagger to try the next address */
+	if (c->nextaddr < c->naddrs && evtimer_pending(&c->staggerev, NULL))
+		evtimer_del(&c->staggerev);
+	attempt_next(c);
+}
+
+static void
+stagger(int fd, short ev, void *d)
+{
+	struct conn *c = d;
+
+	if (c->nextaddr == c->naddrs) {
+		log_debug("connect: timed out");
+		c->connerr = ETIMEDOUT;
+		race_end(c, -1);
+		conn_connected(c, -1);
+		return;
+	}
+
+	attempt_next(c);
+}
+
+/*
+ * Start the connection to the next address, skipping those that fail
+ * right away, and schedule the one after.  Ends the race if there's
+ * nothing left to wait for.
+ */
+static void
+attempt_next(struct conn *c)
+{
+	struct timeval tv;
+	int i, s, flags;
+
+	while (c->nextaddr < c->naddrs) {
+		i = c->nextaddr++;
+
+		s = socket(c->addrs[i].ss_family, SOCK_STREAM, 0);
+		if (s == -1) {
+			log_debug("socket: %s", strerror(errno));
+			c->connerr = errno;
+			continue;
+		}
+
+		if ((flags = fcntl(s, F_GETFL)) == -1 ||
+		    fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+			log_debug("fcntl: %s", strerror(errno));
+			close(s);
+			continue;
+		}
+
+		if (sockopt_apply(&c->tunnel->sockopts, s,
+		    c->addrs[i].ss_family) == -1)
+			log_debug("setsockopt: %s", strerror(errno));
+
+		if (connect(s, (struct sockaddr *)&c->addrs[i],
+		    c->addrlens[i]) == -1 && errno != EINPROGRESS) {
+			log_debug("connect: %s", strerror(errno));
+			c->connerr = errno;
+			close(s);
+			continue;
+		}
+
+		c->attempts[i] = s;
+		c->inflight++;
+		event_assign(&c->attemptev[i], c->worker->base, s, EV_WRITE,
+		    attempt_done, c);
+		event_add(&c->attemptev[i], NULL);
+
+		timerclear(&tv);
+		if (c->nextaddr < c->naddrs)
+			tv.tv_usec = STAGGER;
+		else
+			tv.tv_sec = RACETIMEOUT;
+		evtimer_add(&c->staggerev, &tv);
+		return;
+	}
+
+	if (c->inflight == 0) {
+		race_end(c, -1);
+		conn_connected(c, -1);
+		return;
+	}
+
+	/*
+	 * The rest failed right away but an earlier attempt is still
+	 * pending, and its timer was cancelled to get here: bound the
+	 * wait for it too.
+	 */
+	if (!evtimer_pending(&c->staggerev, NULL)) {
+		timerclear(&tv);
+		tv.tv_sec = RACETIMEOUT;
+		evtimer_add(&c->staggerev, &tv);
+	}
+}
+
+/*
+ * Start connecting c to host:port, resolved through ac; conn_connected
+ * is called with the outcome once done.  Returns -1 if it fails right
+ * away.
+ */
+int
+conn_connect(struct conn *c, struct addrcache *ac, const char *host,
+    const char *port)
+{
+	struct sockaddr_storage addrs[MAXADDRS];
+	socklen_t lens[MAXADDRS];
+	struct timespec now;
+	int i, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&cache_lock);
+	ac->host = host;
+	ac->port = port;
+	if (now.tv_sec >= ac->expire && *host == '/') {
+		/* nothing to wait for */
+		n = lookup(host, port, addrs, lens);
+		cache_update(ac, n, addrs, lens);
+	} else if (now.tv_sec >= ac->expire)
+		cache_refresh(ac);
+	if (ac->n == 0) {
+		/* nothing to use until the resolver is done */
+		pthread_mutex_unlock(&cache_lock);
+		log_debug("%s: not resolved yet", host);
+		return -1;
+	}
+	ac->hits++;
+
+	c->cache = ac;
+	c->naddrs = 0;
+	if (ac->last != -1) {
+		ac->reused++;
+		conn_addr(c, ac->last);
+	}
+	for (i = 0; i < ac->n; ++i)
+		if (i != ac->last)
+			conn_addr(c, i);
+	c->cachegen = ac->gen;
+	pthread_mutex_unlock(&cache_lock);
+
+	for (i = 0; i < c->naddrs; ++i)
+		c->attempts[i] = -1;
+	c->nextaddr = 0;
+	c->inflight = 0;
+	c->connerr = 0;
+	c->connecting = 1;
+	evtimer_assign(&c->staggerev, c->worker->base, stagger, c);
+
+	attempt_next(c);
+	return 0;
+}
+
+/*
+ * Stop connecting, if it was.
+ */
+void
+conn_connect_abort(struct conn *c)
+{
+	if (c->connecting)
+		race_end(c, -1);
+}
+
+void
+connect_log_stats(struct addrcache *ac, const char *name)
+{
+	pthread_mutex_lock(&cache_lock);
+	log_info("%s: resolver: %llu lookups, %llu cached, %llu reused the"
+	    " last address", name, ac->lookups, ac->hits, ac->reused);
+	pthread_mutex_unlock(&cache_lock);
+}
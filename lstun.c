@@ -17,250 +17,1956 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef LIBEVENT_VERSION_NUMBER
+#include <event2/listener.h>
+#endif
+
 #include "log.h"
 #include "lstun.h"
 
-#define MAXSOCK 32
-#define BACKOFF 1
-#define RETRIES 16
-
-const char	*addr;		/* our addr */
-const char	*ssh_tflag;
-const char	*ssh_dest;
-
-char		 ssh_host[256];
-char		 ssh_port[16];
-
-struct event	 sockev[MAXSOCK];
-int		 socks[MAXSOCK];
-int		 nsock;
+#define BACKOFF_MIN	500	/* first retry, in microseconds */
+#define BACKOFF_MAX	1	/* in seconds */
+#define CONNTIMEOUT	16	/* give up connecting after, in seconds */
+#define MAXWORKERS 256
+#define LOADPERIOD	2	/* sample the ssh load every, in seconds */
+#define LOADUNIT	(1024 * 1024)	/* bytes/s worth a connection */
+#define SATCPU		0.8	/* share of a core of a busy ssh */
+#define SATCONNS	32	/* connections of a busy ssh */
+#define DOWNTIME	30	/* skip a failed destination, in seconds */
+#define SPAWNTIMEOUT	5	/* to wait for ssh before failing over */
+#define MINSPAWN	2	/* least time to wait for ssh */
+#define MAXCONNFAILS	3	/* in a row before failing over */
+#define BACKLOG		128	/* default listen(2) backlog */
+#define ACCEPTBATCH	64	/* most clients accepted per wakeup */
+#define DRAINWIN	8	/* waiting clients connecting at once, first */
+#define DEFERACCEPT	5	/* for the client to talk, in seconds */
+
+struct event_base *mainbase;
+struct tunnels	 tunnels = TAILQ_HEAD_INITIALIZER(tunnels);
+
+struct worker	*workers;
+int		 nworkers = 1;
 
 int		 debug;
 int		 verbose;
+long		 clockticks;
 
 struct event	 sighupev;
 struct event	 sigintev;
 struct event	 sigtermev;
 struct event	 sigchldev;
 struct event	 siginfoev;
+struct event	 sigusr2ev;
 
-struct timeval	 timeout = {600, 0}; /* 10 minutes */
-struct event	 timeoutev;
-
-pid_t		 ssh_pid = -1;
-
-int		 conn;
+/*
+ * The workers share the ssh processes: lock protects their state and
+ * the number of connections, and the pool statistics.  The main
+ * thread is woken up via mainpipe when the last connection of an ssh
+ * goes away, to schedule its termination, and when there's a new ssh
+ * to watch.
+ *
+ * ssh runs the LocalCommand once the forwarding is set up, and its
+ * output ends up in a pipe: that's when it's ready.  ready_fd is the
+ * read end for the ssh just spawned, not yet picked up by the main
+ * thread; ready_watch is the one being watched.
+ *
+ * With -M the pid is the control master and the forwarding is added
+ * and removed by running ssh -O, one at a time.
+ *
+ * A tunnel may use up to nprocs ssh, each with its own forwarding,
+ * to spread the encryption over more cores: the first is spawned on
+ * demand as usual, the others when those running are saturated, and
+ * the new connections go to the least loaded.
+ *
+ * With race set ssh is spawned to that many destinations at once, as
+ * masters without the forwarding: the first one ready takes the
+ * place of pid, its control socket is moved to ctlpath and the
+ * forwarding added with ssh -O, the others are killed.
+ *
+ * Upon SIGUSR2 lstun executes itself again and hands the listeners
+ * and the ssh over to the new process, see restart.c, then stops
+ * accepting and exits once its connections are gone.  restarting is
+ * 1 while the new process starts and 2 after it took over: the ssh
+ * are left alone in the meantime.  The ssh taken over aren't
+ * children of the new process, adopted tells which one to poll and to
+ * signal through restart_kill.
+ */
+pthread_mutex_t	 lock = PTHREAD_MUTEX_INITIALIZER;
+int		 mainpipe[2];
+struct event	 mainev;
+
+int		 conn;		/* of all the tunnels */
+int		 restarting;
+struct event	 restartev;
+struct event	 handoverev;
+struct event	 adoptev;
+char		**saved_argv;
+
+size_t		 pool_prealloc = 16;
+size_t		 pool_size;	/* allocated struct conn */
+size_t		 pool_hiwat;	/* max connections at the same time */
+
+static void	ctl_sync(struct sshproc *);
+static pid_t	ssh_kill(struct sshproc *, int);
+static int	spawn_ssh(struct sshproc *);
+static int	ssh_failover(struct sshproc *);
+static void	race_end(struct sshproc *);
+static int	race_reaped(struct sshproc *, pid_t);
+static void	ssh_exited(struct sshproc *);
+static void	ssh_set_ready(struct sshproc *);
+static void	ssh_wakeup(void);
+static void	restart(int, short, void *);
+static void	restart_handover(int, short, void *);
+static void	try_to_connect(int, short, void *);
 
 static void
 sig_handler(int sig, short event, void *data)
 {
-	int status;
+	struct tunnel *t;
+	struct sshproc *p;
+	struct dest *d;
+	pid_t pid;
+	char name[64], cpu[16];
+	int i, status;
 
 	switch (sig) {
 	case SIGHUP:
 	case SIGINT:
 	case SIGTERM:
 		log_info("quitting");
-		event_loopbreak();
+		event_base_loopbreak(mainbase);
 		break;
 	case SIGCHLD:
-		if (waitpid(ssh_pid, &status, WNOHANG) == -1)
-			fatal("waitpid");
-		ssh_pid = -1;
+		pthread_mutex_lock(&lock);
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			TAILQ_FOREACH(t, &tunnels, entry) {
+				for (i = 0; i < t->nprocs; ++i) {
+					p = &t->procs[i];
+					if (pid == p->pid) {
+						ssh_exited(p);
+						break;
+					}
+					if (race_reaped(p, pid))
+						break;
+					if (pid == p->ctl_pid) {
+						p->ctl_pid = -1;
+						if (!WIFEXITED(status) ||
+						    WEXITSTATUS(status) != 0)
+							log_warnx("%s: ssh -O"
+							    " failed", t->name);
+						else if (p->fwd_have &&
+						    p->pid != -1)
+							ssh_set_ready(p);
+						ctl_sync(p);
+						break;
+					}
+				}
+				if (i != t->nprocs)
+					break;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+		break;
+	case SIGUSR2:
+		restart(-1, 0, NULL);
 		break;
 #ifdef SIGINFO
 	case SIGINFO:
 #else
 	case SIGUSR1:
 #endif
-		log_info("connections: %d", conn);
+		pthread_mutex_lock(&lock);
+		log_info("connections: %d; pool: %zu allocated,"
+		    " high-water %zu", conn, pool_size, pool_hiwat);
+		TAILQ_FOREACH(t, &tunnels, entry) {
+			for (i = 0; t->ndests > 1 && i < t->ndests; ++i) {
+				d = &t->dests[i];
+				log_info("%s: %s: ready in %.1fs, rtt %.1fms,"
+				    " %d failures%s", t->name, d->host,
+				    d->ready.avg, d->rtt.avg * 1000, d->fails,
+				    d->down > time(NULL) ? " (down)" : "");
+			}
+
+			p = &t->procs[0];
+			if (t->nprocs == 1) {
+				log_info("%s: connections: %d; ssh %s",
+				    t->name, t->conn, p->racing ? "starting" :
+				    p->pid == -1 ? "not running" : p->ready ?
+				    "ready" : "starting");
+				continue;
+			}
+
+			/* the load is only sampled with more of them */
+			log_info("%s: connections: %d", t->name, t->conn);
+			for (i = 0; i < t->nprocs; ++i) {
+				p = &t->procs[i];
+				if (p->pid == -1 && !p->racing)
+					continue;
+				if (p->cpu < 0)
+					strlcpy(cpu, "unknown", sizeof(cpu));
+				else
+					snprintf(cpu, sizeof(cpu), "%.0f%%",
+					    p->cpu * 100);
+				log_info("%s: ssh %d %s: connections: %d;"
+				    " %.0f KB/s; cpu %s", t->name, i,
+				    p->ready ? "ready" : "starting", p->conn,
+				    p->rate / 1024, cpu);
+			}
+		}
+		pthread_mutex_unlock(&lock);
+		TAILQ_FOREACH(t, &tunnels, entry) {
+			for (i = 0; i < t->nprocs; ++i) {
+				snprintf(name, sizeof(name), "%s/%d", t->name,
+				    i);
+				connect_log_stats(&t->procs[i].cache,
+				    t->nprocs == 1 ? t->name : name);
+			}
+		}
+	}
+}
+
+/*
+ * Whether one of the racers of p is going to d.  Called with lock
+ * held.
+ */
+static int
+racing_to(struct sshproc *p, struct dest *d)
+{
+	int i;
+
+	for (i = 0; i < MAXRACE; ++i)
+		if (p->racers[i].pid != -1 && p->racers[i].dest == d)
+			return 1;
+	return 0;
+}
+
+/*
+ * Return the best destination for p that's not down nor already
+ * raced to: the quickest to have the forwarding ready and to connect
+ * through, the untried first.  If they're all down return NULL, or,
+ * unless up is set, the one that has been down the longest.  Called
+ * with lock held.
+ */
+static struct dest *
+dest_pick(struct sshproc *p, int up)
+{
+	struct tunnel *t = p->tunnel;
+	struct dest *d, *best = NULL;
+	double score, min = 0;
+	time_t now;
+	int i;
+
+	now = time(NULL);
+	for (i = 0; i < t->ndests; ++i) {
+		d = &t->dests[i];
+		if (d->down > now || racing_to(p, d))
+			continue;
+		score = d->ready.avg + d->ready.dev + d->rtt.avg;
+		if (best == NULL || score < min) {
+			best = d;
+			min = score;
+		}
 	}
+	if (best != NULL || up)
+		return best;
+
+	best = &t->dests[0];
+	for (i = 1; i < t->ndests; ++i)
+		if (t->dests[i].down < best->down)
+			best = &t->dests[i];
+	return best;
+}
+
+/*
+ * Whether there's a destination not down other than d.  Called with
+ * lock held.
+ */
+static int
+dest_other(struct tunnel *t, struct dest *d)
+{
+	time_t now;
+	int i;
+
+	now = time(NULL);
+	for (i = 0; i < t->ndests; ++i)
+		if (&t->dests[i] != d && t->dests[i].down <= now)
+			return 1;
+	return 0;
+}
+
+/*
+ * Don't use d for a while, longer the more it fails.  Called with
+ * lock held.
+ */
+static void
+dest_down(struct tunnel *t, struct dest *d, const char *why)
+{
+	time_t secs;
+
+	secs = DOWNTIME << (d->fails < 4 ? d->fails : 4);
+	d->fails++;
+	d->down = time(NULL) + secs;
+	log_warnx("%s: %s %s, skipping it for %llds", t->name, d->host, why,
+	    (long long)secs);
 }
 
+/*
+ * Try another destination for p if it makes sense: there's one not
+ * down and clients are waiting.  Called with lock held.
+ */
 static int
-spawn_ssh(void)
+ssh_failover(struct sshproc *p)
+{
+	struct tunnel *t = p->tunnel;
+
+	if (restarting || t->ndests == 1 || p->conn == 0 ||
+	    dest_pick(p, 1) == NULL)
+		return -1;
+	return spawn_ssh(p);
+}
+
+/*
+ * ssh went away on its own.  Called with lock held.
+ */
+static void
+ssh_exited(struct sshproc *p)
+{
+	p->pid = -1;
+	p->ready = 0;
+	p->fwd_have = 0;
+
+	if (p->spawning) {
+		metrics_add(p->tunnel, M_FAIL_SSH, 1);
+		dest_down(p->tunnel, p->dest, "failed");
+	}
+	if (ssh_failover(p) == 0)
+		return;
+
+	/* let the waiting ones fail */
+	ssh_wakeup();
+}
+
+/*
+ * ssh is taking too long to have the forwarding ready: give another
+ * destination a chance.
+ */
+static void
+spawn_timeout(int fd, short event, void *data)
+{
+	struct sshproc *p = data;
+
+	pthread_mutex_lock(&lock);
+	if (p->pid != -1 && p->spawning && dest_other(p->tunnel, p->dest)) {
+		metrics_add(p->tunnel, M_FAIL_SSH, 1);
+		dest_down(p->tunnel, p->dest, "too slow");
+		ssh_kill(p, SIGTERM);
+		p->pid = -1;
+		if (ssh_failover(p) == -1)
+			ssh_wakeup();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static pid_t
+exec_ssh(const char **argv, int out)
 {
-	log_debug("spawning ssh");
+	sigset_t set;
+	pid_t pid;
 
-	switch (ssh_pid = fork()) {
+	switch (pid = fork()) {
 	case -1:
-		log_warnx("fork");
+		log_warn("fork");
 		return -1;
 	case 0:
-		execl(SSH_PROG, "ssh", "-L", ssh_tflag, "-NTq", ssh_dest,
-		    NULL);
+		if (out != -1 && dup2(out, STDOUT_FILENO) == -1)
+			fatal("dup2");
+
+		/*
+		 * Don't leak the listeners and the connections of the
+		 * other workers to ssh.
+		 */
+		closefrom(3);
+
+		/* the workers run with all the signals blocked */
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+
+		execv(SSH_PROG, (char **)argv);
 		fatal("exec");
 	default:
-		return 0;
+		return pid;
 	}
 }
 
-static void
-killing_time(int fd, short event, void *data)
+/*
+ * The option sets of -P.  They're passed after those of -o and ssh
+ * keeps the first value of each, so they can be overridden one by
+ * one.
+ */
+static const struct {
+	const char	*name;
+	const char	*opts[5];
+} profiles[] = {
+	{ "throughput", {
+		/* AES is in hardware almost everywhere by now */
+		"Ciphers=aes128-gcm@openssh.com,chacha20-poly1305@openssh.com,"
+		    "aes128-ctr",
+		"Compression=no",
+		"IPQoS=cs1",
+		"ServerAliveInterval=30",
+		NULL } },
+	{ "low-latency", {
+		"Compression=no",
+		"IPQoS=af21",
+		"ServerAliveInterval=10",
+		"ServerAliveCountMax=3",
+		NULL } },
+	{ "slow-link", {
+		"Compression=yes",
+		"IPQoS=cs1",
+		"ServerAliveInterval=30",
+		NULL } },
+};
+
+/*
+ * Send sig to the ssh of p.  One taken over from the previous process
+ * may be gone with its pid reused: it's signalled through its pidfd
+ * or, for a master without one, told to exit via its control socket.
+ * Returns the pid of the ssh -O exit in that case, -1 otherwise.
+ */
+static pid_t
+ssh_kill(struct sshproc *p, int sig)
 {
-	if (ssh_pid == -1)
-		return;
+	const char *argv[] = {
+		"ssh", "-S", p->ctlpath, "-O", "exit", "-q", NULL, NULL
+	};
+	pid_t pid = -1;
+
+	if (p->adopted != p->pid) {
+		kill(p->pid, sig);
+		return -1;
+	}
 
-	log_debug("timeout expired, killing ssh (%d)", ssh_pid);
-	kill(ssh_pid, SIGTERM);
-	ssh_pid = -1;
+	if (restart_kill(p, sig) == -1 && errno == ENOSYS) {
+		argv[6] = p->dest->host;
+		pid = exec_ssh(argv, -1);
+	}
+	restart_release(p);
+	return pid;
 }
 
-void
-conn_free(struct conn *c)
+/*
+ * Run ssh to d, as a master on ctlpath if not NULL, and with the
+ * forwarding if fwd is set.  *fd is set to the pipe where it tells
+ * when it's ready.
+ */
+static pid_t
+ssh_start(struct sshproc *p, struct dest *d, const char *ctlpath, int fwd,
+    int *fd)
 {
-	if (c->sourcebev != NULL)
-		bufferevent_free(c->sourcebev);
-	if (c->tobev != NULL)
-		bufferevent_free(c->tobev);
+	struct tunnel *t = p->tunnel;
+	const char **argv;
+	pid_t pid;
+	int i, argc = 0, flags, fds[2];
+
+	if ((argv = reallocarray(NULL, 16 + 2 * t->nsshopts,
+	    sizeof(*argv))) == NULL) {
+		log_warn("reallocarray");
+		return -1;
+	}
 
-	if (evtimer_pending(&c->waitev, NULL))
-		evtimer_del(&c->waitev);
+	if (pipe(fds) == -1) {
+		log_warn("pipe");
+		free(argv);
+		return -1;
+	}
+	if ((flags = fcntl(fds[0], F_GETFL)) == -1 ||
+	    fcntl(fds[0], F_SETFL, flags | O_NONBLOCK) == -1) {
+		log_warn("fcntl");
+		close(fds[0]);
+		close(fds[1]);
+		free(argv);
+		return -1;
+	}
 
-	close(c->source);
-	if (c->to != -1)
-		close(c->to);
+	/* ours first, so that -o can't override them */
+	argv[argc++] = "ssh";
+	if (ctlpath != NULL) {
+		argv[argc++] = "-M";
+		argv[argc++] = "-S";
+		argv[argc++] = ctlpath;
+		/* stay in the foreground, we need to wait(2) for it */
+		argv[argc++] = "-oControlPersist=no";
+	}
+	if (t->unixfwd)
+		argv[argc++] = "-oStreamLocalBindUnlink=yes";
+	argv[argc++] = "-oExitOnForwardFailure=yes";
+	argv[argc++] = "-oPermitLocalCommand=yes";
+	argv[argc++] = "-oLocalCommand=echo";
+	for (i = 0; i < t->nsshopts; ++i) {
+		argv[argc++] = "-o";
+		argv[argc++] = t->sshopts[i];
+	}
+	if (fwd) {
+		argv[argc++] = "-L";
+		argv[argc++] = p->tflag;
+	}
+	argv[argc++] = "-NTq";
+	argv[argc++] = d->host;
+	argv[argc++] = NULL;
+
+	pid = exec_ssh(argv, fds[1]);
+	close(fds[1]);
+	free(argv);
+	if (pid == -1) {
+		close(fds[0]);
+		return -1;
+	}
+
+	*fd = fds[0];
+	metrics_add(t, M_SPAWNS, 1);
+	return pid;
+}
+
+/*
+ * Reset the state of p for the ssh just spawned.  Called with lock
+ * held.
+ */
+static void
+ssh_spawned(struct sshproc *p)
+{
+	p->spawning = 1;
+	p->connfails = 0;
+	p->ready = 0;
+	__atomic_store_n(&p->bytes, 0, __ATOMIC_RELAXED);
+	p->rate = 0;
+	p->cpu = -1;
+	p->sampled = 0;
+
+	/* those waiting for it start over */
+	p->tunnel->retry.tv_sec = 0;
+	p->tunnel->retry.tv_usec = BACKOFF_MIN;
+	p->tunnel->drainwin = DRAINWIN;
+
+	/* have the main thread watch it */
+	write(mainpipe[1], "", 1);
+}
+
+/*
+ * Spawn ssh to up to race destinations at once.  Returns -1 if there
+ * aren't at least two to go to.  Called with lock held.
+ */
+static int
+ssh_race(struct sshproc *p)
+{
+	struct tunnel *t = p->tunnel;
+	struct racer *r;
+	struct dest *d;
+	int i, n, fd;
 
-	free(c);
+	if ((d = dest_pick(p, 1)) == NULL || !dest_other(t, d))
+		return -1;
 
-	if (--conn == 0) {
-		log_debug("scheduling ssh termination (%llds)",
-		    (long long)timeout.tv_sec);
-		if (timeout.tv_sec != 0) {
-			evtimer_set(&timeoutev, killing_time, NULL);
-			evtimer_add(&timeoutev, &timeout);
+	clock_gettime(CLOCK_MONOTONIC, &p->spawned);
+	for (i = 0; i < t->race && d != NULL; ++i) {
+		r = &p->racers[i];
+		r->dest = d;
+		n = snprintf(r->ctlpath, sizeof(r->ctlpath), "%s/race.%d.%u",
+		    t->rundir, p->idx, p->raceseq++);
+		if (n < 0 || (size_t)n >= sizeof(r->ctlpath)) {
+			log_warnx("path too long: %s/race.%d", t->rundir,
+			    p->idx);
+			break;
 		}
+
+		log_debug("%s: racing ssh %d to %s", t->name, p->idx, d->host);
+		if ((r->pid = ssh_start(p, d, r->ctlpath, 0, &fd)) == -1)
+			break;
+		p->racing++;
+
+		/* a previous racer may have died before being watched */
+		if (r->fd != -1)
+			close(r->fd);
+		r->fd = fd;
+
+		d = dest_pick(p, 1);
+	}
+	if (p->racing == 0)
+		return -1;
+
+	p->raced = 0;
+	p->fwd_want = 1;
+	p->fwd_have = 0;
+	ssh_spawned(p);
+	return 0;
+}
+
+/*
+ * Kill the racers of p, if any.  Called with lock held.
+ */
+static void
+race_end(struct sshproc *p)
+{
+	struct racer *r;
+	int i;
+
+	for (i = 0; i < MAXRACE; ++i) {
+		r = &p->racers[i];
+		if (r->pid == -1)
+			continue;
+		kill(r->pid, SIGTERM);
+		r->pid = -1;
+	}
+	p->racing = 0;
+}
+
+/*
+ * r is the first ssh ready: make it the one of p and add the
+ * forwarding.  Called with lock held.
+ */
+static void
+race_won(struct sshproc *p, struct racer *r)
+{
+	struct tunnel *t = p->tunnel;
+
+	log_debug("%s: ssh %d: %s won the race", t->name, p->idx,
+	    r->dest->host);
+
+	if (rename(r->ctlpath, p->ctlpath) == -1) {
+		log_warn("rename %s", r->ctlpath);
+		race_end(p);
+		if (ssh_failover(p) == -1)
+			ssh_wakeup();
+		return;
 	}
+
+	p->pid = r->pid;
+	p->dest = r->dest;
+	p->raced = 1;
+	r->pid = -1;
+	race_end(p);
+
+	/* with -W there's no forwarding to wait for */
+	if (t->muxfwd)
+		ssh_set_ready(p);
+	else
+		ctl_sync(p);
 }
 
+/*
+ * Handle the exit of pid if it's one of the racers of p.  When none
+ * is left try the other destinations, if any.  Called with lock held.
+ */
 static int
-connect_to_ssh(void)
+race_reaped(struct sshproc *p, pid_t pid)
 {
-	struct addrinfo hints, *res, *res0;
-	int r, saved_errno, sock;
-	const char *cause;
+	struct racer *r;
+	int i;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	for (i = 0; i < MAXRACE; ++i) {
+		r = &p->racers[i];
+		if (r->pid == pid)
+			break;
+	}
+	if (i == MAXRACE)
+		return 0;
+
+	r->pid = -1;
+	metrics_add(p->tunnel, M_FAIL_SSH, 1);
+	dest_down(p->tunnel, r->dest, "failed");
+	if (--p->racing == 0 && p->pid == -1 && ssh_failover(p) == -1)
+		ssh_wakeup();
+	return 1;
+}
 
-	r = getaddrinfo(ssh_host, ssh_port, &hints, &res0);
-	if (r != 0) {
-		log_warnx("getaddrinfo(\"%s\", \"%s\"): %s",
-		    ssh_host, ssh_port, gai_strerror(r));
+static int
+spawn_ssh(struct sshproc *p)
+{
+	struct tunnel *t = p->tunnel;
+	int fd;
+
+	if (t->race > 1 && ssh_race(p) == 0)
+		return 0;
+
+	p->dest = dest_pick(p, 0);
+	log_debug("%s: spawning ssh %d to %s", t->name, p->idx, p->dest->host);
+
+	p->pid = ssh_start(p, p->dest, t->master ? p->ctlpath : NULL,
+	    !t->muxfwd, &fd);
+	if (p->pid == -1)
 		return -1;
+	p->fwd_want = p->fwd_have = 1;
+	p->raced = 0;
+	clock_gettime(CLOCK_MONOTONIC, &p->spawned);
+
+	/* a previous ssh may have died before being watched */
+	if (p->ready_fd != -1)
+		close(p->ready_fd);
+	p->ready_fd = fd;
+	ssh_spawned(p);
+	return 0;
+}
+
+/*
+ * Add or cancel the forwarding on the master so that it matches
+ * fwd_want.  Only one ssh -O is run at a time, so the requests reach
+ * the master in order; the next one, if needed, is started when the
+ * previous is reaped.  The winner of a race is a master too.
+ */
+static void
+ctl_sync(struct sshproc *p)
+{
+	struct tunnel *t = p->tunnel;
+	const char *argv[] = {
+		"ssh", "-S", p->ctlpath, "-O", NULL, "-L", p->tflag, "-q",
+		NULL, NULL
+	};
+
+	if ((!t->master && !p->raced) || t->muxfwd || p->pid == -1 ||
+	    p->ctl_pid != -1 || p->fwd_want == p->fwd_have)
+		return;
+
+	argv[4] = p->fwd_want ? "forward" : "cancel";
+	argv[8] = p->dest->host;
+	log_debug("%s: ssh -O %s", t->name, argv[4]);
+	if ((p->ctl_pid = exec_ssh(argv, -1)) != -1) {
+		p->fwd_have = p->fwd_want;
+		p->ready = 0;
+		/* the first time it counts from the spawn */
+		if (!p->spawning)
+			clock_gettime(CLOCK_MONOTONIC, &p->spawned);
+	}
+}
+
+/*
+ * The forwarding is in place: wake up the connections waiting for
+ * it and let the adaptive keep-warm know how long it took.  Called
+ * with lock held.
+ */
+static void
+ssh_set_ready(struct sshproc *p)
+{
+	struct timespec now;
+	double secs;
+
+	if (p->ready)
+		return;
+
+	p->ready = 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - p->spawned.tv_sec +
+	    (now.tv_nsec - p->spawned.tv_nsec) / 1000000000.0;
+	if (p->idx == 0)
+		adapt_ready(&p->tunnel->adapt, secs);
+	if (p->spawning) {
+		metrics_observe(p->tunnel, H_READY, secs);
+		estimate_add(&p->dest->ready, secs);
+		p->dest->fails = 0;
+		p->spawning = 0;
 	}
 
-	for (res = res0; res; res = res->ai_next) {
-		sock = socket(res->ai_family, res->ai_socktype,
-		    res->ai_protocol);
-		if (sock == -1) {
-			cause = "socket";
-			continue;
+	log_debug("%s: ssh %d ready", p->tunnel->name, p->idx);
+	ssh_wakeup();
+}
+
+static void
+ssh_wakeup(void)
+{
+	int i;
+
+	for (i = 0; i < nworkers; ++i)
+		write(workers[i].wakepipe[1], "", 1);
+}
+
+static void
+ready_cb(int fd, short event, void *data)
+{
+	struct sshproc *p = data;
+	char buf[64];
+	ssize_t n;
+
+	if ((n = read(fd, buf, sizeof(buf))) == -1 && errno == EAGAIN)
+		return;
+
+	if (n > 0) {
+		pthread_mutex_lock(&lock);
+		/* don't trust what's left by an ssh that was replaced */
+		if (p->ready_fd == -1 && p->pid != -1)
+			ssh_set_ready(p);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* ssh is gone or closed its stdout */
+	event_del(&p->readyev);
+	close(fd);
+	p->ready_watch = -1;
+}
+
+static void
+race_cb(int fd, short event, void *data)
+{
+	struct racer *r = data;
+	char buf[64];
+	ssize_t n;
+
+	if ((n = read(fd, buf, sizeof(buf))) == -1 && errno == EAGAIN)
+		return;
+
+	if (n > 0) {
+		pthread_mutex_lock(&lock);
+		/* the race may be over, or it's a previous one */
+		if (r->fd == -1 && r->pid != -1)
+			race_won(r->proc, r);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/* either way, there's nothing more to know */
+	event_del(&r->ev);
+	close(fd);
+	r->watch = -1;
+}
+
+/*
+ * Make sure ssh is running and forwarding.  Called with lock held.
+ */
+static int
+ssh_warm(struct sshproc *p)
+{
+	/* don't touch what's being handed over */
+	if (restarting && (p->pid == -1 || !p->fwd_have))
+		return -1;
+
+	if (p->pid == -1 && !p->racing && spawn_ssh(p) == -1)
+		return -1;
+
+	p->fwd_want = 1;
+	ctl_sync(p);
+	return 0;
+}
+
+static void
+killing_time(int fd, short event, void *data)
+{
+	struct sshproc *p = data;
+	struct tunnel *t = p->tunnel;
+	struct timeval tv;
+	time_t keep;
+
+	pthread_mutex_lock(&lock);
+	if (restarting) {
+		/* the new process may not make it */
+		if (restarting == 1) {
+			timerclear(&tv);
+			tv.tv_sec = 1;
+			evtimer_add(&p->timeoutev, &tv);
+		}
+		goto done;
+	}
+	if (p->racing && p->conn == 0) {
+		log_debug("%s: timeout expired, ending the race of ssh %d",
+		    t->name, p->idx);
+		race_end(p);
+	}
+	if (p->pid != -1 && p->conn == 0) {
+		/*
+		 * With -W there's no forwarding to cancel, and the
+		 * additional masters aren't worth keeping.
+		 */
+		if (t->master && !t->muxfwd && p->idx == 0) {
+			log_debug("%s: timeout expired, cancelling the"
+			    " forwarding", t->name);
+			p->fwd_want = 0;
+			ctl_sync(p);
+		} else {
+			log_debug("%s: timeout expired, killing ssh %d (%d)",
+			    t->name, p->idx, p->pid);
+			ssh_kill(p, SIGTERM);
+			p->pid = -1;
+			p->ready = 0;
 		}
 
-		if (connect(sock, res->ai_addr, res->ai_addrlen) == -1) {
-			cause = "connect";
-			saved_errno = errno;
-			close(sock);
-			errno = saved_errno;
-			sock = -1;
-			continue;
+		if (p->idx != 0)
+			goto done;
+
+		timerclear(&tv);
+		tv.tv_sec = adapt_prespawn(&t->adapt, time(NULL), &keep);
+		if (tv.tv_sec != -1) {
+			log_debug("%s: expecting the next connections in"
+			    " %llds", t->name, (long long)tv.tv_sec);
+			timerclear(&t->prespawnkeep);
+			t->prespawnkeep.tv_sec = keep;
+			evtimer_add(&t->prespawnev, &tv);
 		}
+	}
+done:
+	pthread_mutex_unlock(&lock);
+}
 
-		break;
+static void
+prespawn(int fd, short event, void *data)
+{
+	struct tunnel *t = data;
+	struct sshproc *p = &t->procs[0];
+
+	pthread_mutex_lock(&lock);
+	if (t->conn == 0 && !p->racing && (p->pid == -1 || !p->fwd_have)) {
+		log_debug("%s: warming up the tunnel (%llds)", t->name,
+		    (long long)t->prespawnkeep.tv_sec);
+		if (ssh_warm(p) == 0)
+			evtimer_add(&p->timeoutev, &t->prespawnkeep);
 	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Return the cpu time used so far by pid, in clock ticks, or -1 if
+ * it's not known.
+ */
+static long long
+proc_ticks(pid_t pid)
+{
+	FILE *fp;
+	char path[64], buf[512], *s;
+	unsigned long long utime, stime;
+	int r;
 
-	if (sock == -1)
-		log_warn("%s", cause);
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	s = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+
+	/* the command name may contain spaces and parenthesis */
+	if (s == NULL || (s = strrchr(buf, ')')) == NULL)
+		return -1;
+	r = sscanf(s + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+	    " %llu %llu", &utime, &stime);
+	if (r != 2)
+		return -1;
+	return utime + stime;
+}
+
+/*
+ * Whether p can't take more: it's burning a whole core, or, where the
+ * cpu usage can't be measured, it has already many connections.
+ */
+static int
+ssh_saturated(struct sshproc *p)
+{
+	if (p->cpu >= 0)
+		return p->cpu >= SATCPU;
+	return p->conn >= SATCONNS;
+}
+
+/*
+ * Sample the load of the ssh of the tunnel and spawn another one
+ * when all those running are saturated.
+ */
+static void
+tunnel_load(int fd, short event, void *data)
+{
+	struct tunnel *t = data;
+	struct sshproc *p, *idle = NULL;
+	struct timeval tv;
+	unsigned long long bytes;
+	long long ticks;
+	int i, running = 0, saturated = 0;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < t->nprocs; ++i) {
+		p = &t->procs[i];
+		if (p->pid == -1) {
+			if (idle == NULL && !p->racing)
+				idle = p;
+			continue;
+		}
+
+		bytes = __atomic_exchange_n(&p->bytes, 0, __ATOMIC_RELAXED);
+		p->rate += ((double)bytes / LOADPERIOD - p->rate) / 2;
+
+		if (clockticks <= 0 || (ticks = proc_ticks(p->pid)) == -1)
+			p->cpu = -1;
+		else {
+			if (p->sampled)
+				p->cpu = (double)(ticks - p->ticks) /
+				    clockticks / LOADPERIOD;
+			p->ticks = ticks;
+			p->sampled = 1;
+		}
+
+		if (!p->ready)
+			continue;
+		running++;
+		if (ssh_saturated(p))
+			saturated++;
+	}
+
+	if (running != 0 && running == saturated && idle != NULL) {
+		log_info("%s: %d ssh saturated, spawning another", t->name,
+		    running);
+		if (ssh_warm(idle) == 0 && t->timeout.tv_sec != 0)
+			/* in case the load goes away before it's used */
+			evtimer_add(&idle->timeoutev, &t->timeout);
+	}
+	pthread_mutex_unlock(&lock);
+
+	timerclear(&tv);
+	tv.tv_sec = LOADPERIOD;
+	evtimer_add(&t->loadev, &tv);
+}
+
+/*
+ * Start watching the ssh just spawned, and give up on it if it takes
+ * much longer than usual when there are other destinations to try.
+ * Called with lock held.
+ */
+static void
+ssh_watch(struct sshproc *p)
+{
+	struct estimate *e = &p->dest->ready;
+	struct timeval tv;
+
+	if (p->ready_watch != -1) {
+		event_del(&p->readyev);
+		close(p->ready_watch);
+	}
+	p->ready_watch = p->ready_fd;
+	p->ready_fd = -1;
+	event_assign(&p->readyev, mainbase, p->ready_watch,
+	    EV_READ|EV_PERSIST, ready_cb, p);
+	event_add(&p->readyev, NULL);
+
+	if (p->tunnel->ndests == 1)
+		return;
+
+	timerclear(&tv);
+	tv.tv_sec = SPAWNTIMEOUT;
+	if (e->n >= 2) {
+		tv.tv_sec = e->avg + 4 * e->dev + 1;
+		if (tv.tv_sec < MINSPAWN)
+			tv.tv_sec = MINSPAWN;
+		if (tv.tv_sec > SPAWNTIMEOUT)
+			tv.tv_sec = SPAWNTIMEOUT;
+	}
+	evtimer_add(&p->spawnev, &tv);
+}
+
+/*
+ * Start watching a racer just spawned.  Called with lock held.
+ */
+static void
+race_watch(struct racer *r)
+{
+	if (r->watch != -1) {
+		event_del(&r->ev);
+		close(r->watch);
+	}
+	r->watch = r->fd;
+	r->fd = -1;
+	event_assign(&r->ev, mainbase, r->watch, EV_READ|EV_PERSIST, race_cb,
+	    r);
+	event_add(&r->ev, NULL);
+}
+
+static void
+main_cb(int fd, short event, void *data)
+{
+	struct tunnel *t;
+	struct sshproc *p;
+	struct timeval tv;
+	char buf[64];
+	int i, j;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		/* drain */;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		for (i = 0; i < t->nprocs; ++i) {
+			p = &t->procs[i];
+			if (p->ready_fd != -1)
+				ssh_watch(p);
+			for (j = 0; j < MAXRACE; ++j)
+				if (p->racers[j].fd != -1)
+					race_watch(&p->racers[j]);
+
+			if (!p->idle)
+				continue;
+			p->idle = 0;
+
+			if (p->conn != 0 || t->timeout.tv_sec == 0)
+				continue;
+
+			tv = t->timeout;
+			if (p->idx == 0)
+				tv.tv_sec = adapt_keep(&t->adapt, time(NULL));
+			log_debug("%s: scheduling ssh %d termination (%llds)",
+			    t->name, i, (long long)tv.tv_sec);
+			evtimer_add(&p->timeoutev, &tv);
+		}
+	}
+	if (restarting == 2 && conn == 0) {
+		log_info("drained, quitting");
+		event_base_loopbreak(mainbase);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Whether no ssh is starting up or running ssh -O, so that they can
+ * be handed over.  Called with lock held.
+ */
+static int
+ssh_quiet(void)
+{
+	struct tunnel *t;
+	struct sshproc *p;
+	int i;
+
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		for (i = 0; i < t->nprocs; ++i) {
+			p = &t->procs[i];
+			if (p->racing || p->ctl_pid != -1 ||
+			    p->ready_fd != -1 ||
+			    (p->pid != -1 && p->spawning))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Execute the new process and wait for it to take over, see
+ * restart.c.
+ */
+static void
+restart(int fd, short event, void *data)
+{
+	struct timeval tv;
+
+	pthread_mutex_lock(&lock);
+	if (restarting) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	if (!ssh_quiet()) {
+		pthread_mutex_unlock(&lock);
+		log_debug("waiting for ssh to settle before restarting");
+		timerclear(&tv);
+		tv.tv_sec = 1;
+		evtimer_add(&restartev, &tv);
+		return;
+	}
+
+	log_info("restarting");
+	restarting = 1;
+	if ((fd = restart_exec(saved_argv)) == -1)
+		restarting = 0;
+	pthread_mutex_unlock(&lock);
+
+	/* have the workers stop, or start again, accepting */
+	ssh_wakeup();
+
+	if (fd == -1) {
+		log_warnx("can't restart");
+		return;
+	}
+	event_assign(&handoverev, mainbase, fd, EV_READ, restart_handover,
+	    NULL);
+	event_add(&handoverev, NULL);
+}
+
+static void
+restart_handover(int fd, short event, void *data)
+{
+	char buf[2];
+	ssize_t n;
+	int drained;
+
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	pthread_mutex_lock(&lock);
+	if (n == 2 && !memcmp(buf, "ok", 2)) {
+		log_info("the new process took over, draining %d"
+		    " connections", conn);
+		restarting = 2;
+	} else {
+		log_warnx("the new process failed to start, carrying on");
+		restarting = 0;
+	}
+	drained = restarting == 2 && conn == 0;
+	pthread_mutex_unlock(&lock);
+
+	ssh_wakeup();
+	if (restarting == 2)
+		metrics_stop();
+	if (drained)
+		event_base_loopbreak(mainbase);
+}
+
+/*
+ * The ssh taken over from the previous process aren't our children,
+ * there's no SIGCHLD for them: poll them to know when they're gone.
+ */
+static void
+adopt_check(int fd, short event, void *data)
+{
+	struct tunnel *t;
+	struct sshproc *p;
+	struct timeval tv;
+	int i, left = 0;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		for (i = 0; i < t->nprocs; ++i) {
+			p = &t->procs[i];
+			if (p->adopted == 0)
+				continue;
+			if (p->pid != p->adopted)
+				restart_release(p);
+			else if (!restart_alive(p)) {
+				log_debug("%s: ssh %d (%d) exited", t->name,
+				    i, p->pid);
+				restart_release(p);
+				ssh_exited(p);
+			} else
+				left++;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (left != 0) {
+		timerclear(&tv);
+		tv.tv_sec = 1;
+		evtimer_add(&adoptev, &tv);
+	}
+}
+
+/*
+ * Pick the ssh for a new connection and make sure it's running: the
+ * least loaded of those ready, by number of connections and recent
+ * traffic, or the first one.  *ready is set to whether it's ready.
+ * Returns NULL on error.
+ */
+static struct sshproc *
+ssh_hold(struct tunnel *t, int *ready)
+{
+	struct sshproc *p, *best = NULL;
+	double load, min = 0;
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < t->nprocs; ++i) {
+		p = &t->procs[i];
+		if (p->pid == -1 || !p->ready)
+			continue;
+		load = p->conn + p->rate / LOADUNIT;
+		if (best == NULL || load < min) {
+			best = p;
+			min = load;
+		}
+	}
+	if (best == NULL)
+		best = &t->procs[0];
+
+	if (ssh_warm(best) == -1)
+		best = NULL;
+	else {
+		*ready = best->ready;
+		best->conn++;
+		if (t->conn++ == 0)
+			adapt_arrival(&t->adapt, time(NULL));
+		if ((size_t)++conn > pool_hiwat)
+			pool_hiwat = conn;
+	}
+	pthread_mutex_unlock(&lock);
+	return best;
+}
+
+static void
+ssh_release(struct sshproc *p)
+{
+	pthread_mutex_lock(&lock);
+	conn--;
+	if (--p->tunnel->conn == 0)
+		adapt_idle(&p->tunnel->adapt, time(NULL));
+	if (--p->conn == 0) {
+		p->idle = 1;
+		write(mainpipe[1], "", 1);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * A connection went through: if ssh didn't tell us yet, it's ready
+ * anyway.
+ */
+static void
+ssh_connected(struct conn *c)
+{
+	struct sshproc *p = c->proc;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&lock);
+	ssh_set_ready(p);
+	p->connfails = 0;
+	estimate_add(&p->dest->rtt, now.tv_sec - c->tried.tv_sec +
+	    (now.tv_nsec - c->tried.tv_nsec) / 1000000000.0);
+	pthread_mutex_unlock(&lock);
+
+	metrics_add(c->tunnel, M_CONNECTED, 1);
+	metrics_observe(c->tunnel, H_CONNECT, now.tv_sec - c->since.tv_sec +
+	    (now.tv_nsec - c->since.tv_nsec) / 1000000000.0);
+}
+
+/*
+ * A connection through p failed even though it's ready: if that keeps
+ * happening move to another destination.
+ */
+static void
+ssh_connfailed(struct sshproc *p)
+{
+	pthread_mutex_lock(&lock);
+	if (!restarting && p->pid != -1 && p->ready &&
+	    ++p->connfails >= MAXCONNFAILS &&
+	    dest_other(p->tunnel, p->dest)) {
+		metrics_add(p->tunnel, M_FAIL_FORWARD, 1);
+		dest_down(p->tunnel, p->dest, "doesn't forward");
+		ssh_kill(p, SIGTERM);
+		p->pid = -1;
+		p->ready = 0;
+		p->fwd_have = 0;
+		if (ssh_failover(p) == -1)
+			ssh_wakeup();
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static int
+ssh_running(struct sshproc *p)
+{
+	int r;
+
+	pthread_mutex_lock(&lock);
+	r = p->pid != -1 || p->racing;
+	pthread_mutex_unlock(&lock);
+	return r;
+}
+
+/*
+ * Account n bytes moved by c to its ssh, from the client if in is set.
+ */
+void
+conn_account(struct conn *c, size_t n, int in)
+{
+	/* after every read: no lock, tunnel_load takes them */
+	__atomic_add_fetch(&c->proc->bytes, n, __ATOMIC_RELAXED);
+	metrics_add(c->tunnel, in ? M_BYTES_IN : M_BYTES_OUT, n);
+}
+
+/*
+ * Grow the pool of connections of the worker by n.  The struct conn
+ * are never given back to the system, they (and whatever the splice
+ * backend attached to them) are recycled by conn_free.
+ */
+static int
+pool_grow(struct worker *w, size_t n)
+{
+	struct conn *c;
+	size_t i;
+
+	if ((c = calloc(n, sizeof(*c))) == NULL)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		c[i].worker = w;
+		SLIST_INSERT_HEAD(&w->pool, &c[i], entry);
+	}
+	w->pool_size += n;
+
+	pthread_mutex_lock(&lock);
+	pool_size += n;
+	pthread_mutex_unlock(&lock);
+
+	log_debug("grown connection pool to %zu", w->pool_size);
+	return 0;
+}
+
+static struct conn *
+conn_new(struct worker *w, struct sshproc *p, int s, struct origin *o)
+{
+	struct conn *c;
+
+	if (SLIST_EMPTY(&w->pool) && pool_grow(w, w->pool_size) == -1)
+		return NULL;
+
+	c = SLIST_FIRST(&w->pool);
+	SLIST_REMOVE_HEAD(&w->pool, entry);
+
+	/* whatever the previous connection left, not its buffers */
+	memset((char *)c + offsetof(struct conn, tunnel), 0,
+	    sizeof(*c) - offsetof(struct conn, tunnel));
+
+	c->tunnel = p->tunnel;
+	c->proc = p;
+	c->origin = o;
+	c->source = s;
+	c->to = -1;
+	clock_gettime(CLOCK_MONOTONIC, &c->since);
+	return c;
+}
+
+/*
+ * Have the worker look for a prober among those waiting after the
+ * delay of the tunnel of the first in line.
+ */
+static void
+probe_schedule(struct worker *w)
+{
+	struct conn *c;
+	struct timeval tv;
+
+	if ((c = TAILQ_FIRST(&w->waiting)) == NULL ||
+	    evtimer_pending(&w->probeev, NULL))
+		return;
+
+	pthread_mutex_lock(&lock);
+	tv = c->tunnel->retry;
+	pthread_mutex_unlock(&lock);
+	evtimer_add(&w->probeev, &tv);
+}
+
+/*
+ * Wait in line for the tunnel to be ready.  Only one client of the
+ * tunnel, in whatever worker, tries to connect again, with a delay
+ * that grows exponentially: it's only a fallback, all of them are
+ * retried as soon as ssh tells us that the forwarding is in place, or
+ * the prober gets through.
+ */
+static void
+conn_park(struct conn *c)
+{
+	struct worker *w = c->worker;
+	struct tunnel *t = c->tunnel;
+
+	pthread_mutex_lock(&lock);
+	if (t->prober == c) {
+		/* back in front, and wait longer: it stays the prober */
+		TAILQ_INSERT_HEAD(&w->waiting, c, wentry);
+		if (t->retry.tv_sec < BACKOFF_MAX) {
+			t->retry.tv_usec *= 2;
+			if (t->retry.tv_usec >= 1000000) {
+				t->retry.tv_sec = BACKOFF_MAX;
+				t->retry.tv_usec = 0;
+			}
+		}
+	} else
+		TAILQ_INSERT_TAIL(&w->waiting, c, wentry);
+	pthread_mutex_unlock(&lock);
+	c->waiting = 1;
+
+	probe_schedule(w);
+}
+
+static void
+conn_unpark(struct conn *c)
+{
+	struct worker *w = c->worker;
+
+	if (c->waiting) {
+		TAILQ_REMOVE(&w->waiting, c, wentry);
+		c->waiting = 0;
+	}
+
+	if (TAILQ_EMPTY(&w->waiting) && evtimer_pending(&w->probeev, NULL))
+		evtimer_del(&w->probeev);
+}
+
+/*
+ * Try again with the prober of a tunnel if it's in our line, or with
+ * the first in line of a tunnel nobody is probing, or just wait some
+ * more.
+ */
+static void
+probe(int fd, short event, void *data)
+{
+	struct worker *w = data;
+	struct conn *c;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(c, &w->waiting, wentry) {
+		if (c->tunnel->prober == NULL || c->tunnel->prober == c) {
+			c->tunnel->prober = c;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* conn_park has us wait longer if it fails */
+	if (c != NULL)
+		try_to_connect(-1, 0, c);
+	else
+		probe_schedule(w);
+}
+
+/*
+ * A client released by drain got through if ok is 1, or failed if
+ * -1: open the window wider, or shrink it and leave the rest to the
+ * prober.
+ */
+static void
+drain_done(struct conn *c, int ok)
+{
+	struct tunnel *t = c->tunnel;
+	int wake;
+
+	c->released = 0;
+
+	pthread_mutex_lock(&lock);
+	t->draining--;
+	if (ok == 1)
+		t->drainwin++;
+	else if (ok == -1 && t->drainwin > 1)
+		t->drainwin /= 2;
+	wake = ok != -1 && t->drainwait;
+	if (wake)
+		t->drainwait = 0;
+	pthread_mutex_unlock(&lock);
+
+	/* there's room for those another worker had to hold back */
+	if (wake)
+		ssh_wakeup();
+}
+
+void
+conn_free(struct conn *c)
+{
+	struct tunnel *t = c->tunnel;
+
+	pthread_mutex_lock(&lock);
+	if (t->prober == c)
+		t->prober = NULL;
+	pthread_mutex_unlock(&lock);
+	if (c->released)
+		drain_done(c, 0);
+
+	conn_unsplice(c);
+	conn_unpark(c);
+	probe_schedule(c->worker);
+	conn_connect_abort(c);
+	mux_close(c);
+
+	if (c->source != -1)
+		close(c->source);
+	if (c->to != -1)
+		close(c->to);
+
+	/* let the workers stopped on the limit accept again */
+	if (admit_release(c->origin))
+		ssh_wakeup();
+
+	SLIST_INSERT_HEAD(&c->worker->pool, c, entry);
+	ssh_release(c->proc);
+}
+
+static void
+try_to_connect(int fd, short event, void *d)
+{
+	struct conn *c = d;
+	struct tunnel *t = c->tunnel;
+	struct sshproc *p = c->proc;
+
+	conn_unpark(c);
+
+	/* ssh may have died in the meantime */
+	if (!ssh_running(p)) {
+		conn_free(c);
+		return;
+	}
+
+	c->ntentative++;
+	clock_gettime(CLOCK_MONOTONIC, &c->tried);
+	if (t->muxfwd) {
+		log_debug("%s: asking the master to forward to %s:%d (%d)",
+		    t->name, t->mux_host, t->mux_port, c->ntentative);
+		if (mux_connect(c, p->ctlpath, t->mux_host, t->mux_port) == -1)
+			conn_connected(c, -1);
+		return;
+	}
+
+	log_debug("%s: trying to connect to %s%s%s (%d)", t->name, p->host,
+	    t->unixfwd ? "" : ":", p->port, c->ntentative);
+
+	if (conn_connect(c, &p->cache, p->host, p->port) == -1)
+		conn_connected(c, -1);
+}
+
+/*
+ * The tunnel through p isn't coming up: fail the connections waiting
+ * in line for it too, in every worker, they'd only run into the same.
+ */
+static void
+conn_giveup(struct conn *c)
+{
+	struct sshproc *p = c->proc;
+
+	log_warnx("%s: giving up connecting", c->tunnel->name);
+	metrics_add(c->tunnel, M_FAIL_CONNECT, 1);
+
+	pthread_mutex_lock(&lock);
+	clock_gettime(CLOCK_MONOTONIC, &p->giveup);
+	pthread_mutex_unlock(&lock);
+
+	conn_free(c);
+	ssh_wakeup();
+}
+
+void
+conn_connected(struct conn *c, int r)
+{
+	struct tunnel *t = c->tunnel;
+	struct timespec now;
+	int probed;
+
+	if (c->released)
+		drain_done(c, r == -1 ? -1 : 1);
+
+	if (r == -1) {
+		ssh_connfailed(c->proc);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - c->since.tv_sec >= CONNTIMEOUT) {
+			conn_giveup(c);
+			return;
+		}
+
+		metrics_add(c->tunnel, M_RETRIES, 1);
+		conn_park(c);
+		return;
+	}
+
+	/* it's through: let the others follow */
+	pthread_mutex_lock(&lock);
+	if ((probed = t->prober == c)) {
+		t->prober = NULL;
+		t->retry.tv_sec = 0;
+		t->retry.tv_usec = BACKOFF_MIN;
+	}
+	pthread_mutex_unlock(&lock);
+	if (probed)
+		ssh_wakeup();
+
+	log_info("connected!");
+	ssh_connected(c);
+
+	/* the master took the client, see mux.c */
+	if (c->tunnel->muxfwd)
+		return;
+
+	if (conn_splice(c) == -1) {
+		metrics_add(c->tunnel, M_FAIL_SPLICE, 1);
+		conn_free(c);
+	}
+}
+
+/*
+ * Stop accepting while restarting or over the admission limits, start
+ * again when it failed or there's room, and drop the listeners once
+ * the new process took over.
+ */
+static void
+worker_listen(struct worker *w)
+{
+	struct listener *l;
+	int i, on, state;
+
+	pthread_mutex_lock(&lock);
+	state = restarting;
+	pthread_mutex_unlock(&lock);
+
+	on = state == 0 && !w->paused;
+	for (i = 0; i < w->nlisteners; ++i) {
+		l = &w->listeners[i];
+		if (l->fd == -1)
+			continue;
+#ifdef LIBEVENT_VERSION_NUMBER
+		l->accepted = 0;
+		if (on && !w->listening)
+			evconnlistener_enable(l->lev);
+		else if (!on && w->listening)
+			evconnlistener_disable(l->lev);
+		if (state == 2)
+			evconnlistener_free(l->lev);
+#else
+		if (on && !w->listening)
+			event_add(&l->ev, NULL);
+		else if (!on && w->listening)
+			event_del(&l->ev);
+#endif
+		if (state == 2) {
+			close(l->fd);
+			l->fd = -1;
+		}
+	}
+	w->listening = on;
+}
+
+/*
+ * Retry the connections waiting for an ssh that is now either ready or
+ * gone, in order, and drop those that were waiting already when the
+ * tunnel was given up on.  Through a ready ssh, only as many go at once
+ * as the window of the tunnel lets: it grows by one with each of them
+ * getting through and halves when one fails, not to flood ssh with
+ * channels to open nor starve the connections already going.
+ */
+static void
+drain(int fd, short event, void *data)
+{
+	struct worker *w = data;
+	struct sshproc *p;
+	struct tunnel *t;
+	struct conn *c, *tc;
+	TAILQ_HEAD(, conn) q = TAILQ_HEAD_INITIALIZER(q);
+	TAILQ_HEAD(, conn) dq = TAILQ_HEAD_INITIALIZER(dq);
+
+	/* try_to_connect may park them again */
+	pthread_mutex_lock(&lock);
+	for (c = TAILQ_FIRST(&w->waiting); c != NULL; c = tc) {
+		tc = TAILQ_NEXT(c, wentry);
+		p = c->proc;
+		t = c->tunnel;
+		if (c->since.tv_sec < p->giveup.tv_sec ||
+		    (c->since.tv_sec == p->giveup.tv_sec &&
+		    c->since.tv_nsec <= p->giveup.tv_nsec)) {
+			TAILQ_REMOVE(&w->waiting, c, wentry);
+			TAILQ_INSERT_TAIL(&dq, c, wentry);
+			continue;
+		}
+		if (p->ready) {
+			if (t->draining >= t->drainwin) {
+				t->drainwait = 1;
+				continue;
+			}
+			t->draining++;
+			c->released = 1;
+		} else if (p->pid != -1 || p->racing)
+			continue;
+		TAILQ_REMOVE(&w->waiting, c, wentry);
+		TAILQ_INSERT_TAIL(&q, c, wentry);
+	}
+	pthread_mutex_unlock(&lock);
+
+	while ((c = TAILQ_FIRST(&dq)) != NULL) {
+		TAILQ_REMOVE(&dq, c, wentry);
+		c->waiting = 0;
+		metrics_add(c->tunnel, M_FAIL_CONNECT, 1);
+		log_warnx("%s: dropped a waiting client", c->tunnel->name);
+		conn_free(c);
+	}
+
+	while ((c = TAILQ_FIRST(&q)) != NULL) {
+		TAILQ_REMOVE(&q, c, wentry);
+		c->waiting = 0;
+		try_to_connect(-1, 0, c);
+	}
 
-	freeaddrinfo(res0);
-	return sock;
+	probe_schedule(w);
 }
 
 static void
-try_to_connect(int fd, short event, void *d)
+wake_cb(int fd, short event, void *data)
 {
-	struct conn *c = d;
+	struct worker *w = data;
+	char buf[64];
 
-	/* ssh may have died in the meantime */
-	if (ssh_pid == -1) {
-		conn_free(c);
-		return;
-	}
+	while (read(fd, buf, sizeof(buf)) > 0)
+		/* drain */;
 
-	c->ntentative++;
-	log_info("trying to connect to %s:%s (%d/%d)", ssh_host, ssh_port,
-	    c->ntentative, RETRIES);
+	/* maybe a client went away, do_accept checks again anyway */
+	w->paused = 0;
+	worker_listen(w);
+	drain(-1, 0, w);
+}
 
-	if ((c->to = connect_to_ssh()) == -1) {
-		if (c->ntentative == RETRIES) {
-			log_warnx("giving up connecting");
-			conn_free(c);
-			return;
-		}
+static void
+admit_resume(int fd, short event, void *data)
+{
+	struct worker *w = data;
 
-		evtimer_set(&c->waitev, try_to_connect, c);
-		evtimer_add(&c->waitev, &c->retry);
-		return;
-	}
+	w->paused = 0;
+	worker_listen(w);
+}
 
-	log_info("connected!");
+/*
+ * Turn away a client over the limits with a reset: it's the cheapest
+ * for both ends, nothing lingers in TIME_WAIT.
+ */
+static void
+client_reject(struct listener *l, int s)
+{
+	struct linger lg;
 
-	if (conn_splice(c) == -1)
-		conn_free(c);
+	log_debug("%s: rejecting connection", l->tunnel->name);
+	metrics_add(l->tunnel, M_REJECTED, 1);
+
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	setsockopt(s, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(s);
 }
 
 static void
-do_accept(int fd, short event, void *data)
+client_new(struct listener *l, int s, struct sockaddr *sa)
 {
+	struct sshproc *p;
+	struct origin *o;
 	struct conn *c;
-	int s;
-
-	log_debug("incoming connection");
+	int ready;
 
-	if ((s = accept(fd, NULL, 0)) == -1) {
-		log_warn("accept");
+	if (admit_conn(sa, &o) == -1) {
+		client_reject(l, s);
 		return;
 	}
 
-	if (ssh_pid == -1 && spawn_ssh() == -1) {
+	log_debug("%s: incoming connection", l->tunnel->name);
+	metrics_add(l->tunnel, M_ACCEPTED, 1);
+
+	if ((p = ssh_hold(l->tunnel, &ready)) == NULL) {
+		metrics_add(l->tunnel, M_FAIL_SPAWN, 1);
 		close(s);
+		if (admit_release(o))
+			ssh_wakeup();
 		return;
 	}
 
-	if ((c = calloc(1, sizeof(*c))) == NULL) {
+	if ((c = conn_new(l->worker, p, s, o)) == NULL) {
 		log_warn("calloc");
+		metrics_add(l->tunnel, M_FAIL_NOMEM, 1);
 		close(s);
+		if (admit_release(o))
+			ssh_wakeup();
+		ssh_release(p);
 		return;
 	}
 
-	conn++;
-	if (evtimer_pending(&timeoutev, NULL))
-		evtimer_del(&timeoutev);
+	if (ready)
+		try_to_connect(-1, 0, c);
+	else
+		conn_park(c);
+}
 
-	c->source = s;
-	c->to = -1;
-	c->retry.tv_sec = BACKOFF;
-	evtimer_set(&c->waitev, try_to_connect, c);
-	evtimer_add(&c->waitev, &c->retry);
+/*
+ * Stop accepting until a client goes away, or for usec.
+ */
+static void
+admit_pause(struct worker *w, long usec)
+{
+	struct timeval tv;
+
+	w->paused = 1;
+	worker_listen(w);
+
+	if (usec > 0) {
+		tv.tv_sec = usec / 1000000;
+		tv.tv_usec = usec % 1000000;
+		evtimer_add(&w->admitev, &tv);
+	}
+}
+
+#ifdef LIBEVENT_VERSION_NUMBER
+/*
+ * A client taken by the evconnlistener of l, which drains the backlog
+ * until it would block.  Stop after ACCEPTBATCH clients not to starve
+ * the connections already going, and over the admission limits to
+ * leave the rest in the listen queue.
+ */
+static void
+client_accept(struct evconnlistener *lev, evutil_socket_t s,
+    struct sockaddr *sa, int len, void *data)
+{
+	struct listener *l = data;
+	long wait;
+
+	client_new(l, s, sa);
+
+	if ((wait = admit_check()) != 0)
+		admit_pause(l->worker, wait);
+	else if (++l->accepted == ACCEPTBATCH)
+		admit_pause(l->worker, 1);	/* the next time around */
+}
+
+static void
+accept_error(struct evconnlistener *lev, void *data)
+{
+	if (errno != ECONNABORTED && errno != EINTR)
+		log_warn("accept");
+}
+#else
+/*
+ * Drain the backlog, but at most ACCEPTBATCH clients at a time not to
+ * starve the connections already going.  Over the admission limits
+ * the rest is left in the listen queue.
+ */
+static void
+do_accept(int fd, short event, void *data)
+{
+	struct listener *l = data;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	long wait;
+	int i, s;
+
+	for (i = 0; i < ACCEPTBATCH; ++i) {
+		if ((wait = admit_check()) != 0) {
+			admit_pause(l->worker, wait);
+			return;
+		}
+
+		len = sizeof(ss);
+#if HAVE_ACCEPT4
+		s = accept4(fd, (struct sockaddr *)&ss, &len,
+		    SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+		s = accept(fd, (struct sockaddr *)&ss, &len);
+#endif
+		if (s == -1) {
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_warn("accept");
+			return;
+		}
+		client_new(l, s, (struct sockaddr *)&ss);
+	}
 }
+#endif
 
 static const char *
 copysec(const char *s, char *d, size_t len)
@@ -276,13 +1982,16 @@ copysec(const char *s, char *d, size_t len)
 	return c;
 }
 
-static void
-bind_socket(void)
+/*
+ * Resolve the address of a tunnel once for all the workers.
+ */
+static struct addrinfo *
+resolve_addr(const char *addr)
 {
-	struct addrinfo hints, *res, *res0;
-	int v, r, saved_errno;
+	struct addrinfo hints, *res0;
+	int r;
 	char host[64];
-	const char *c, *h, *port, *cause;
+	const char *c, *h, *port;
 
 	if ((c = strchr(addr, ':')) == NULL) {
 		h = "localhost";
@@ -303,79 +2012,427 @@ bind_socket(void)
 	r = getaddrinfo(h, port, &hints, &res0);
 	if (r != 0)
 		fatalx("getaddrinfo(%s): %s", addr, gai_strerror(r));
+	return res0;
+}
 
-	for (res = res0; res && nsock < MAXSOCK; res = res->ai_next) {
-		socks[nsock] = socket(res->ai_family, res->ai_socktype,
-		    res->ai_protocol);
-		if (socks[nsock] == -1) {
-			cause = "socket";
-			continue;
-		}
+static int
+open_socket(struct addrinfo *res, const char **cause)
+{
+	int s, v, saved_errno;
 
-		v = 1;
-		if (setsockopt(socks[nsock], SOL_SOCKET, SO_REUSEADDR, &v,
-		    sizeof(v)) == -1)
-			fatal("setsockopt(SO_REUSEADDR)");
+	s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (s == -1) {
+		*cause = "socket";
+		return -1;
+	}
 
-		v = 1;
-		if (setsockopt(socks[nsock], SOL_SOCKET, SO_REUSEPORT, &v,
-		    sizeof(v)) == -1)
-			fatal("setsockopt(SO_REUSEPORT)");
+	v = 1;
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v)) == -1)
+		fatal("setsockopt(SO_REUSEADDR)");
+
+	v = 1;
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v)) == -1)
+		fatal("setsockopt(SO_REUSEPORT)");
+
+	if (bind(s, res->ai_addr, res->ai_addrlen) == -1) {
+		*cause = "bind";
+		saved_errno = errno;
+		close(s);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return s;
+}
+
+static void
+bind_socket(struct worker *w, struct tunnel *t, struct addrinfo *res0)
+{
+	struct addrinfo *res;
+	struct listener *l;
+	int socks[MAXSOCK];
+	int i, n = 0, s, v, flags;
+	const char *cause;
 
-		if (bind(socks[nsock], res->ai_addr, res->ai_addrlen) == -1) {
-			cause = "bind";
-			saved_errno = errno;
-			close(socks[nsock]);
-			errno = saved_errno;
+	for (res = res0; res && n < MAXSOCK; res = res->ai_next) {
+		/* the one of the previous process, if any, see restart.c */
+		s = restart_socket(res->ai_addr, res->ai_addrlen);
+		if (s == -1 && (s = open_socket(res, &cause)) == -1)
 			continue;
-		}
 
-		if (listen(socks[nsock], 5) == -1)
+#ifdef TCP_DEFER_ACCEPT
+		v = DEFERACCEPT;
+		if (t->deferaccept && setsockopt(s, IPPROTO_TCP,
+		    TCP_DEFER_ACCEPT, &v, sizeof(v)) == -1)
+			fatal("setsockopt(TCP_DEFER_ACCEPT)");
+#endif
+#ifdef TCP_FASTOPEN
+		v = t->fastopen;
+		if (v != 0 && setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, &v,
+		    sizeof(v)) == -1)
+			fatal("setsockopt(TCP_FASTOPEN)");
+#endif
+		/* inherited by the accepted sockets */
+		if (sockopt_apply(&t->sockopts, s, res->ai_family) == -1)
+			fatal("%s: setsockopt", t->addr);
+
+		if (listen(s, t->backlog) == -1)
 			fatal("listen");
 
-		nsock++;
+		/* drained until accept would block */
+		if ((flags = fcntl(s, F_GETFL)) == -1 ||
+		    fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1)
+			fatal("fcntl");
+
+		socks[n++] = s;
 	}
-	if (nsock == 0)
-		fatal("%s", cause);
+	if (n == 0)
+		fatal("%s: %s", t->addr, cause);
+
+	l = reallocarray(w->listeners, w->nlisteners + n, sizeof(*l));
+	if (l == NULL)
+		fatal("reallocarray");
+	w->listeners = l;
+
+	for (i = 0; i < n; ++i) {
+		l = &w->listeners[w->nlisteners++];
+		memset(l, 0, sizeof(*l));
+		l->tunnel = t;
+		l->worker = w;
+		l->fd = socks[i];
+	}
+}
 
-	freeaddrinfo(res0);
+/*
+ * Return the host:hostport part of the forwarding, or NULL if it's
+ * malformed.
+ */
+static const char *
+sshaddr_remote(struct tunnel *t)
+{
+	const char *c;
+
+	if ((c = strrchr(t->sshaddr, ':')) == NULL || c == t->sshaddr)
+		return NULL;
+	while (c > t->sshaddr && c[-1] != ':')
+		c--;
+	if (*c == ':')
+		return NULL;
+	return c;
 }
 
 static void
-parse_sshaddr(void)
+parse_sshaddr(struct tunnel *t)
 {
-	const char *c;
+	struct sshproc *p = &t->procs[0];
+	const char *c, *remote, *errstr;
+	int i, port, r;
 
-	if (isdigit((unsigned char)*ssh_tflag)) {
-		strlcpy(ssh_host, "localhost", sizeof(ssh_host));
-		if (copysec(ssh_tflag, ssh_port, sizeof(ssh_port)) == NULL)
+	/* only host:hostport matter, the rest is in place of the socket */
+	if (t->unixfwd) {
+		if (sshaddr_remote(t) == NULL)
 			goto err;
 		return;
 	}
 
-	if ((c = copysec(ssh_tflag, ssh_host, sizeof(ssh_host))) == NULL)
-		goto err;
-	if (copysec(c+1, ssh_port, sizeof(ssh_port)) == NULL)
+	/* the master connects to host:hostport itself */
+	if (t->muxfwd) {
+		if ((c = sshaddr_remote(t)) == NULL ||
+		    (c = copysec(c, t->mux_host, sizeof(t->mux_host))) == NULL)
+			goto err;
+		t->mux_port = strtonum(c + 1, 1, 65535, &errstr);
+		if (errstr != NULL)
+			fatalx("%s: port is %s: %s", t->name, errstr, c + 1);
+		return;
+	}
+
+	strlcpy(p->tflag, t->sshaddr, sizeof(p->tflag));
+	if (isdigit((unsigned char)*t->sshaddr)) {
+		strlcpy(p->host, "localhost", sizeof(p->host));
+		if (copysec(t->sshaddr, p->port, sizeof(p->port)) == NULL)
+			goto err;
+	} else {
+		if ((c = copysec(t->sshaddr, p->host, sizeof(p->host))) == NULL)
+			goto err;
+		if (copysec(c+1, p->port, sizeof(p->port)) == NULL)
+			goto err;
+	}
+
+	if (t->nprocs == 1)
+		return;
+
+	/* the others forward the ports that follow */
+	if ((remote = sshaddr_remote(t)) == NULL)
 		goto err;
+	port = strtonum(p->port, 1, 65535 - t->nprocs + 1, &errstr);
+	if (errstr != NULL)
+		fatalx("%s: port is %s: %s", t->name, errstr, p->port);
+	for (i = 1; i < t->nprocs; ++i) {
+		strlcpy(t->procs[i].host, p->host, sizeof(p->host));
+		snprintf(t->procs[i].port, sizeof(p->port), "%d", port + i);
+		if (isdigit((unsigned char)*t->sshaddr))
+			r = snprintf(t->procs[i].tflag, sizeof(p->tflag),
+			    "%d:%s", port + i, remote);
+		else
+			r = snprintf(t->procs[i].tflag, sizeof(p->tflag),
+			    "%s:%d:%s", p->host, port + i, remote);
+		if (r < 0 || (size_t)r >= sizeof(p->tflag))
+			goto err;
+	}
 	return;
 
 err:
-	fatalx("wrong value for -B");
+	fatalx("%s: wrong forwarding: %s", t->name, t->sshaddr);
+}
+
+static void
+make_rundir(struct tunnel *t)
+{
+	struct sshproc *p;
+	const char *c;
+	int i, r;
+
+	/* it may have been handed over with the ssh */
+	if (*t->rundir == '\0') {
+		strlcpy(t->rundir, "/tmp/lstun.XXXXXXXXXX",
+		    sizeof(t->rundir));
+		if (mkdtemp(t->rundir) == NULL)
+			fatal("mkdtemp");
+	}
+
+	for (i = 0; i < t->nprocs; ++i) {
+		p = &t->procs[i];
+
+		r = snprintf(p->ctlpath, sizeof(p->ctlpath), "%s/ctl.%d",
+		    t->rundir, i);
+		if (r < 0 || (size_t)r >= sizeof(p->ctlpath))
+			fatalx("path too long: %s/ctl.%d", t->rundir, i);
+
+		if (!t->unixfwd)
+			continue;
+
+		/*
+		 * Have ssh listen on a unix-domain socket in there and
+		 * connect to it instead of going through the loopback.
+		 */
+		r = snprintf(p->fwdpath, sizeof(p->fwdpath), "%s/fwd.%d",
+		    t->rundir, i);
+		if (r < 0 || (size_t)r >= sizeof(p->fwdpath) ||
+		    strlcpy(p->host, p->fwdpath, sizeof(p->host)) >=
+		    sizeof(p->host))
+			fatalx("path too long: %s/fwd.%d", t->rundir, i);
+		*p->port = '\0';
+
+		/* keep host:hostport */
+		c = sshaddr_remote(t);
+		r = snprintf(p->tflag, sizeof(p->tflag), "%s:%s", p->fwdpath,
+		    c);
+		if (r < 0 || (size_t)r >= sizeof(p->tflag))
+			fatalx("forwarding too long: %s:%s", p->fwdpath, c);
+	}
+}
+
+struct tunnel *
+tunnel_new(const char *name)
+{
+	struct tunnel *t;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL ||
+	    (t->name = strdup(name)) == NULL)
+		fatal("calloc");
+
+	t->timeout.tv_sec = 600;	/* 10 minutes */
+	t->nprocs = 1;
+	t->race = 1;
+	t->backlog = BACKLOG;
+
+	TAILQ_INSERT_TAIL(&tunnels, t, entry);
+	return t;
+}
+
+void
+tunnel_add_dest(struct tunnel *t, const char *host)
+{
+	struct dest *d;
+
+	d = reallocarray(t->dests, t->ndests + 1, sizeof(*t->dests));
+	if (d == NULL)
+		fatal("reallocarray");
+	t->dests = d;
+
+	d = &t->dests[t->ndests++];
+	memset(d, 0, sizeof(*d));
+	if ((d->host = strdup(host)) == NULL)
+		fatal("strdup");
+}
+
+void
+tunnel_add_sshopt(struct tunnel *t, const char *opt)
+{
+	char **o;
+
+	o = reallocarray(t->sshopts, t->nsshopts + 1, sizeof(*t->sshopts));
+	if (o == NULL)
+		fatal("reallocarray");
+	t->sshopts = o;
+
+	if ((t->sshopts[t->nsshopts++] = strdup(opt)) == NULL)
+		fatal("strdup");
+}
+
+static void
+add_profile(struct tunnel *t)
+{
+	size_t i, j;
+
+	for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+		if (strcmp(profiles[i].name, t->sshprofile) != 0)
+			continue;
+		for (j = 0; profiles[i].opts[j] != NULL; ++j)
+			tunnel_add_sshopt(t, profiles[i].opts[j]);
+		return;
+	}
+	fatalx("%s: unknown ssh profile: %s", t->name, t->sshprofile);
+}
+
+/*
+ * Return the number of clients of the tunnel and of ssh running.
+ */
+void
+tunnel_status(struct tunnel *t, int *nconn, int *running)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	*nconn = t->conn;
+	*running = 0;
+	for (i = 0; i < t->nprocs; ++i)
+		if (t->procs[i].pid != -1)
+			(*running)++;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Check the tunnel and prepare everything that doesn't depend on the
+ * event loop.
+ */
+static void
+tunnel_setup(struct tunnel *t)
+{
+	struct sshproc *p;
+	int i, j;
+
+	if (t->addr == NULL)
+		fatalx("%s: missing address to bind", t->name);
+	if (t->sshaddr == NULL)
+		fatalx("%s: missing forwarding", t->name);
+	if (t->ndests == 0)
+		fatalx("%s: missing destination", t->name);
+	if (t->unixfwd && t->muxfwd)
+		fatalx("%s: -u and -W are mutually exclusive", t->name);
+#ifndef TCP_DEFER_ACCEPT
+	if (t->deferaccept)
+		fatalx("%s: can't defer accept on this system", t->name);
+#endif
+#ifndef TCP_FASTOPEN
+	if (t->fastopen != 0)
+		fatalx("%s: TCP Fast Open is not available on this system",
+		    t->name);
+#endif
+	if (t->unixfwd && !backend->unixok)
+		fatalx("%s: can't splice unix-domain sockets with %s",
+		    t->name, backend->name);
+	if (t->muxfwd)
+		t->master = 1;
+
+	if (t->sshprofile != NULL)
+		add_profile(t);
+
+	t->retry.tv_usec = BACKOFF_MIN;
+	t->drainwin = DRAINWIN;
+
+	if ((t->procs = calloc(t->nprocs, sizeof(*t->procs))) == NULL)
+		fatal("calloc");
+	for (i = 0; i < t->nprocs; ++i) {
+		p = &t->procs[i];
+		p->tunnel = t;
+		p->idx = i;
+		p->pid = -1;
+		p->ctl_pid = -1;
+		p->pidfd = -1;
+		p->ready_fd = -1;
+		p->ready_watch = -1;
+		p->cpu = -1;
+		for (j = 0; j < MAXRACE; ++j) {
+			p->racers[j].proc = p;
+			p->racers[j].pid = -1;
+			p->racers[j].fd = -1;
+			p->racers[j].watch = -1;
+		}
+	}
+
+	parse_sshaddr(t);
+
+	/* the first lookup, the resolver thread does the others */
+	if (!t->muxfwd && !t->unixfwd)
+		for (i = 0; i < t->nprocs; ++i)
+			connect_resolve(&t->procs[i].cache, t->procs[i].host,
+			    t->procs[i].port);
 }
 
 static void __dead
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-dv] -B sshaddr -b addr [-t timeout]"
-	    " destination\n", getprogname());
+	fprintf(stderr, "usage: %s [-DdMuvW] [-a statefile] -B sshaddr -b addr"
+	    " [-C clients]\n\t[-c clients] [-F qlen] [-g memory] [-j workers]"
+	    " [-l backlog]\n\t[-m metrics] [-n procs] [-o option]"
+	    " [-P profile] [-p conns]\n\t[-R rate] [-r race] [-S sockopts]"
+	    " [-s backend] [-t timeout]\n\t[-w bufsize] destination ...\n"
+	    "       %s [-dv] [-C clients] [-c clients] [-g memory] [-j workers]"
+	    "\n\t[-m metrics] [-p conns] [-R rate] [-s backend] [-w bufsize]"
+	    " -f file\n",
+	    getprogname(), getprogname());
 	exit(1);
 }
 
+static void *
+worker_loop(void *arg)
+{
+	struct worker *w = arg;
+
+	event_base_dispatch(w->base);
+	return NULL;
+}
+
+static void
+make_pipe(int p[2])
+{
+	int i, flags;
+
+	if (pipe(p) == -1)
+		fatal("pipe");
+	for (i = 0; i < 2; ++i) {
+		if ((flags = fcntl(p[i], F_GETFL)) == -1 ||
+		    fcntl(p[i], F_SETFL, flags | O_NONBLOCK) == -1)
+			fatal("fcntl");
+	}
+}
+
 int
 main(int argc, char **argv)
 {
-	int ch, i, fd;
-	const char *errstr;
+	struct tunnel *t, cli;
+	struct worker *w;
+	struct listener *l;
+	struct addrinfo *res0;
+	struct timeval tv;
+	pthread_t tid;
+	sigset_t set, oset;
+	pid_t pid;
+	int ch, i, j, fd, rundir = 0, flags = 0;
+	const char *errstr, *conffile = NULL, *metrics = NULL;
+	const char *splice = NULL;
+	char promises[128];
 	struct stat sb;
 
 	/*
@@ -397,26 +2454,153 @@ main(int argc, char **argv)
 	log_init(1, LOG_DAEMON);
 	log_setverbose(1);
 
-	while ((ch = getopt(argc, argv, "B:b:dt:v")) != -1) {
+	/* to execute it again, see restart */
+	saved_argv = argv;
+
+	/* the tunnel given on the command line, if any */
+	memset(&cli, 0, sizeof(cli));
+	cli.timeout.tv_sec = 600;
+	cli.nprocs = 1;
+	cli.race = 1;
+	cli.backlog = BACKLOG;
+
+	while ((ch = getopt(argc, argv,
+	    "a:B:b:C:c:DdF:f:g:j:l:Mm:n:o:P:p:R:r:S:s:t:uvWw:")) != -1) {
 		switch (ch) {
+		case 'a':
+			cli.statefile = optarg;
+			flags = 1;
+			break;
 		case 'B':
-			ssh_tflag = optarg;
-			parse_sshaddr();
+			cli.sshaddr = optarg;
+			flags = 1;
 			break;
 		case 'b':
-			addr = optarg;
+			cli.addr = optarg;
+			flags = 1;
+			break;
+		case 'C':
+			admit_maxsource = strtonum(optarg, 1, INT_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				fatalx("number of clients per address is %s:"
+				    " %s", errstr, optarg);
+			break;
+		case 'c':
+			admit_max = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("number of clients is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'D':
+			cli.deferaccept = 1;
+			flags = 1;
 			break;
 		case 'd':
 			debug = 1;
 			break;
+		case 'F':
+			cli.fastopen = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("fast open queue is %s: %s", errstr,
+				    optarg);
+			flags = 1;
+			break;
+		case 'f':
+			conffile = optarg;
+			break;
+		case 'g':
+			bufmemmax = strtonum(optarg, 0, INT_MAX, &errstr);
+			bufmemmax *= 1024;
+			if (errstr != NULL)
+				fatalx("memory limit is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'j':
+			nworkers = strtonum(optarg, 1, MAXWORKERS, &errstr);
+			if (errstr != NULL)
+				fatalx("number of workers is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'l':
+			cli.backlog = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("backlog is %s: %s", errstr, optarg);
+			flags = 1;
+			break;
+		case 'M':
+			cli.master = 1;
+			flags = 1;
+			break;
+		case 'm':
+			metrics = optarg;
+			break;
+		case 'n':
+			cli.nprocs = strtonum(optarg, 1, MAXPROCS, &errstr);
+			if (errstr != NULL)
+				fatalx("number of ssh is %s: %s", errstr,
+				    optarg);
+			flags = 1;
+			break;
+		case 'o':
+			tunnel_add_sshopt(&cli, optarg);
+			flags = 1;
+			break;
+		case 'P':
+			cli.sshprofile = optarg;
+			flags = 1;
+			break;
+		case 'p':
+			pool_prealloc = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("number of connections is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'R':
+			admit_rate = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("rate of clients is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'r':
+			cli.race = strtonum(optarg, 1, MAXRACE, &errstr);
+			if (errstr != NULL)
+				fatalx("number of destinations to race is %s:"
+				    " %s", errstr, optarg);
+			flags = 1;
+			break;
+		case 'S':
+			if (sockopt_parse(&cli.sockopts, optarg, &errstr) == -1)
+				fatalx("socket options %s: %s", errstr, optarg);
+			flags = 1;
+			break;
+		case 's':
+			splice = optarg;
+			break;
 		case 't':
-			timeout.tv_sec = strtonum(optarg, 0, INT_MAX, &errstr);
+			cli.timeout.tv_sec = strtonum(optarg, 0, INT_MAX,
+			    &errstr);
 			if (errstr != NULL)
 				fatalx("timeout is %s: %s", errstr, optarg);
+			flags = 1;
+			break;
+		case 'u':
+			cli.unixfwd = 1;
+			flags = 1;
 			break;
 		case 'v':
 			verbose = 1;
 			break;
+		case 'W':
+			cli.muxfwd = 1;
+			flags = 1;
+			break;
+		case 'w':
+			bufmax = strtonum(optarg, 2, INT_MAX, &errstr) * 1024;
+			if (errstr != NULL)
+				fatalx("buffer size is %s: %s", errstr,
+				    optarg);
+			break;
 		default:
 			usage();
 		}
@@ -424,63 +2608,245 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1 || addr == NULL || ssh_tflag == NULL)
-		usage();
+	if (splice_select(splice) == -1)
+		fatalx("backend not available: %s", splice);
+
+	if (conffile != NULL) {
+		if (argc != 0 || flags)
+			usage();
+		parse_config(conffile);
+		if (TAILQ_EMPTY(&tunnels))
+			fatalx("%s: no tunnel defined", conffile);
+	} else {
+		if (argc == 0 || cli.addr == NULL || cli.sshaddr == NULL)
+			usage();
+		t = tunnel_new(argv[0]);
+		t->addr = cli.addr;
+		t->sshaddr = cli.sshaddr;
+		for (i = 0; i < argc; ++i)
+			tunnel_add_dest(t, argv[i]);
+		t->statefile = cli.statefile;
+		t->timeout = cli.timeout;
+		t->master = cli.master;
+		t->unixfwd = cli.unixfwd;
+		t->muxfwd = cli.muxfwd;
+		t->nprocs = cli.nprocs;
+		t->race = cli.race;
+		t->backlog = cli.backlog;
+		t->deferaccept = cli.deferaccept;
+		t->fastopen = cli.fastopen;
+		t->sockopts = cli.sockopts;
+		t->sshopts = cli.sshopts;
+		t->nsshopts = cli.nsshopts;
+		t->sshprofile = cli.sshprofile;
+	}
 
-	ssh_dest = argv[0];
+	TAILQ_FOREACH(t, &tunnels, entry)
+		tunnel_setup(t);
+	restart_inherit();
 
-	bind_socket();
+	if ((workers = calloc(nworkers, sizeof(*workers))) == NULL)
+		fatal("calloc");
+	for (i = 0; i < nworkers; ++i) {
+		SLIST_INIT(&workers[i].pool);
+		TAILQ_INIT(&workers[i].waiting);
+	}
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		res0 = resolve_addr(t->addr);
+		for (i = 0; i < nworkers; ++i)
+			bind_socket(&workers[i], t, res0);
+		freeaddrinfo(res0);
+	}
+	if (metrics != NULL)
+		metrics_listen(metrics);
 
 	log_init(debug, LOG_DAEMON);
 	log_setverbose(verbose);
 
+	for (i = 0; i < nworkers; ++i)
+		if (pool_grow(&workers[i], pool_prealloc) == -1)
+			fatal("calloc");
+
+	TAILQ_FOREACH(t, &tunnels, entry)
+		adapt_init(&t->adapt, t->statefile, t->timeout.tv_sec);
+
 	if (!debug)
 		daemon(1, 0);
 
 	signal(SIGPIPE, SIG_IGN);
 
-	event_init();
+	clockticks = sysconf(_SC_CLK_TCK);
+
+	if ((mainbase = event_base_new()) == NULL)
+		fatalx("event_base_new");
+
+	/* initialize the timers */
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		for (i = 0; i < t->nprocs; ++i) {
+			evtimer_assign(&t->procs[i].timeoutev, mainbase,
+			    killing_time, &t->procs[i]);
+			evtimer_assign(&t->procs[i].spawnev, mainbase,
+			    spawn_timeout, &t->procs[i]);
+		}
+		evtimer_assign(&t->prespawnev, mainbase, prespawn, t);
 
-	/* initialize the timer */
-	evtimer_set(&timeoutev, killing_time, NULL);
+		if (t->nprocs > 1) {
+			evtimer_assign(&t->loadev, mainbase, tunnel_load, t);
+			timerclear(&tv);
+			tv.tv_sec = LOADPERIOD;
+			evtimer_add(&t->loadev, &tv);
+		}
+	}
 
-	signal_set(&sighupev, SIGHUP, sig_handler, NULL);
-	signal_set(&sigintev, SIGINT, sig_handler, NULL);
-	signal_set(&sigtermev, SIGTERM, sig_handler, NULL);
-	signal_set(&sigchldev, SIGCHLD, sig_handler, NULL);
+	metrics_start();
+
+	make_pipe(mainpipe);
+	event_assign(&mainev, mainbase, mainpipe[0], EV_READ|EV_PERSIST,
+	    main_cb, NULL);
+	event_add(&mainev, NULL);
+
+	/* schedule the termination of the ssh taken over, if any */
+	write(mainpipe[1], "", 1);
+	evtimer_assign(&adoptev, mainbase, adopt_check, NULL);
+	timerclear(&tv);
+	evtimer_add(&adoptev, &tv);	/* once the control sockets are set */
+	evtimer_assign(&restartev, mainbase, restart, NULL);
+
+	evsignal_assign(&sighupev, mainbase, SIGHUP, sig_handler, NULL);
+	evsignal_assign(&sigintev, mainbase, SIGINT, sig_handler, NULL);
+	evsignal_assign(&sigtermev, mainbase, SIGTERM, sig_handler, NULL);
+	evsignal_assign(&sigchldev, mainbase, SIGCHLD, sig_handler, NULL);
+	evsignal_assign(&sigusr2ev, mainbase, SIGUSR2, sig_handler, NULL);
 #ifdef SIGINFO
-	signal_set(&siginfoev, SIGINFO, sig_handler, NULL);
+	evsignal_assign(&siginfoev, mainbase, SIGINFO, sig_handler, NULL);
 #else
-	signal_set(&siginfoev, SIGUSR1, sig_handler, NULL);
+	evsignal_assign(&siginfoev, mainbase, SIGUSR1, sig_handler, NULL);
 #endif
 
 	signal_add(&sighupev, NULL);
 	signal_add(&sigintev, NULL);
 	signal_add(&sigtermev, NULL);
 	signal_add(&sigchldev, NULL);
+	signal_add(&sigusr2ev, NULL);
 	signal_add(&siginfoev, NULL);
 
-	for (i = 0; i < nsock; ++i) {
-		event_set(&sockev[i], socks[i], EV_READ|EV_PERSIST,
-		    do_accept, NULL);
-		event_add(&sockev[i], NULL);
+	/*
+	 * With only one worker everything runs in the main thread,
+	 * otherwise each worker gets its own thread and event base.
+	 */
+	for (i = 0; i < nworkers; ++i) {
+		w = &workers[i];
+		if (nworkers == 1)
+			w->base = mainbase;
+		else if ((w->base = event_base_new()) == NULL)
+			fatalx("event_base_new");
+
+		for (j = 0; j < w->nlisteners; ++j) {
+			l = &w->listeners[j];
+#ifdef LIBEVENT_VERSION_NUMBER
+			l->lev = evconnlistener_new(w->base, client_accept,
+			    l, LEV_OPT_CLOSE_ON_EXEC, 0, l->fd);
+			if (l->lev == NULL)
+				fatalx("evconnlistener_new");
+			evconnlistener_set_error_cb(l->lev, accept_error);
+#else
+			event_assign(&l->ev, w->base, l->fd,
+			    EV_READ|EV_PERSIST, do_accept, l);
+			event_add(&l->ev, NULL);
+#endif
+		}
+		w->listening = 1;
+
+		make_pipe(w->wakepipe);
+		event_assign(&w->wakeev, w->base, w->wakepipe[0],
+		    EV_READ|EV_PERSIST, wake_cb, w);
+		event_add(&w->wakeev, NULL);
+
+		evtimer_assign(&w->probeev, w->base, probe, w);
+		evtimer_assign(&w->admitev, w->base, admit_resume, w);
 	}
 
 	if (unveil(SSH_PROG, "x") == -1)
 		fatal("unveil(%s)", SSH_PROG);
+	if (strchr(saved_argv[0], '/') != NULL &&
+	    unveil(saved_argv[0], "x") == -1)
+		fatal("unveil(%s)", saved_argv[0]);
+	if (metrics != NULL && *metrics == '/' && unveil(metrics, "c") == -1)
+		fatal("unveil(%s)", metrics);
+
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		if (!t->master && !t->unixfwd && t->race == 1 &&
+		    *t->rundir == '\0')
+			continue;
+		make_rundir(t);
+		if (unveil(t->rundir, "rwc") == -1)
+			fatal("unveil(%s)", t->rundir);
+		if (rundir == 0 || t->muxfwd)
+			rundir = t->muxfwd ? 2 : 1;
+	}
 
 	/*
 	 * dns, inet: bind the socket and connect to the childs.
-	 * proc, exec: execute ssh on demand.
+	 * proc, exec: execute ssh on demand, and lstun to restart.
+	 * unix, cpath: connect to ssh and clean up the runtime directory.
+	 * sendfd: pass the clients to the master with -W.
+	 * unix, cpath: serve the metrics on a unix-domain socket, remove it.
 	 */
-	if (pledge("stdio dns inet proc exec", NULL) == -1)
+	strlcpy(promises, "stdio dns inet proc exec", sizeof(promises));
+	if (rundir || (metrics != NULL && *metrics == '/'))
+		strlcat(promises, " unix cpath", sizeof(promises));
+	if (rundir == 2)
+		strlcat(promises, " sendfd", sizeof(promises));
+	if (pledge(promises, NULL) == -1)
 		fatal("pledge");
 
+	restart_done();
 	log_info("starting");
-	event_dispatch();
+	log_debug("moving the data with %s", backend->name);
+
+	if (nworkers > 1) {
+		/* signals are handled only by the main thread */
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &oset);
+		for (i = 0; i < nworkers; ++i) {
+			if ((errno = pthread_create(&tid, NULL, worker_loop,
+			    &workers[i])) != 0)
+				fatal("pthread_create");
+			pthread_detach(tid);
+		}
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	}
+
+	event_base_dispatch(mainbase);
+
+	/* the ssh and the runtime directories belong to the new process */
+	if (restarting == 2)
+		return 0;
+
+	metrics_close();
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		for (i = 0; i < t->nprocs; ++i) {
+			/* the control socket has to be there for -O exit */
+			if (t->procs[i].pid != -1 &&
+			    (pid = ssh_kill(&t->procs[i], SIGINT)) != -1)
+				waitpid(pid, NULL, 0);
+			race_end(&t->procs[i]);
+		}
+	}
+	pthread_mutex_unlock(&lock);
 
-	if (ssh_pid != -1)
-		kill(ssh_pid, SIGINT);
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		if (!rundir || *t->rundir == '\0')
+			continue;
+		for (i = 0; i < t->nprocs; ++i) {
+			unlink(t->procs[i].ctlpath);
+			if (t->unixfwd)
+				unlink(t->procs[i].fwdpath);
+		}
+		rmdir(t->rundir);
+	}
 
 	return 0;
 }
@@ -14,15 +14,416 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define MAXSOCK 32
+#define MAXADDRS 8
+#define MAXPROCS 64
+#define MAXRACE 4
+#define BUFMAX (256 * 1024)
+#define BUFMEMMAX (64 * 1024 * 1024)
+
+#ifndef LIBEVENT_VERSION_NUMBER
+/* libevent 1.4, as in OpenBSD base */
+#define event_assign(ev, b, fd, what, cb, arg)				\
+	(event_set(ev, fd, what, cb, arg), event_base_set(b, ev))
+#define evtimer_assign(ev, b, cb, arg)					\
+	event_assign(ev, b, -1, 0, cb, arg)
+#define evsignal_assign(ev, b, sig, cb, arg)				\
+	event_assign(ev, b, sig, EV_SIGNAL|EV_PERSIST, cb, arg)
+#define evbuffer_get_length(buf)	EVBUFFER_LENGTH(buf)
+#define bufferevent_get_input(bev)	EVBUFFER_INPUT(bev)
+#define bufferevent_get_output(bev)	EVBUFFER_OUTPUT(bev)
+#endif
+
+struct conn;
+struct evconnlistener;
+struct origin;
+struct tunnel;
+struct worker;
+
+struct listener {
+	struct tunnel		*tunnel;
+	struct worker		*worker;
+	int			 fd;
+#ifdef LIBEVENT_VERSION_NUMBER
+	struct evconnlistener	*lev;
+	int			 accepted;	/* since the last yield */
+#else
+	struct event		 ev;
+#endif
+};
+
+struct worker {
+	struct event_base	*base;
+	struct listener		*listeners;
+	int			 nlisteners;
+	SLIST_HEAD(, conn)	 pool;
+	size_t			 pool_size;
+	TAILQ_HEAD(, conn)	 waiting;	/* for the tunnel */
+	struct event		 probeev;
+	int			 wakepipe[2];
+	struct event		 wakeev;
+	int			 listening;
+	int			 paused;	/* by admission control */
+	struct event		 admitev;
+	struct uring		*uring;		/* splice_uring.c */
+};
+
+/* adaptive keep-warm, see adapt.c */
+struct estimate {
+	double			 avg;
+	double			 dev;
+	long long		 n;
+};
+
+struct adapt {
+	int			 statefd;
+	time_t			 maxkeep;	/* the timeout */
+	struct estimate		 intra;		/* gaps within a burst */
+	struct estimate		 period;	/* start to start of bursts */
+	struct estimate		 ready;		/* spawn to tunnel ready */
+	time_t			 lastburst;	/* start of the last burst */
+	time_t			 idlesince;	/* since the tunnel is idle */
+};
+
+/* resolved addresses of the forwarding, see connect.c */
+struct addrcache {
+	struct sockaddr_storage	 addrs[MAXADDRS];
+	socklen_t		 lens[MAXADDRS];
+	int			 n;
+	int			 last;		/* last that worked */
+	unsigned int		 gen;
+	time_t			 expire;
+
+	/* refreshed by the resolver thread, see connect.c */
+	const char		*host;
+	const char		*port;
+	int			 resolving;
+	struct addrcache	*rnext;
+
+	unsigned long long	 lookups;	/* getaddrinfo calls */
+	unsigned long long	 hits;		/* served by the cache */
+	unsigned long long	 reused;	/* last address first */
+};
+
+/* counters and histograms, see metrics.c */
+enum {
+	M_ACCEPTED,
+	M_REJECTED,		/* by admission control */
+	M_CONNECTED,
+	M_RETRIES,
+	M_SPAWNS,
+	M_BYTES_IN,		/* from the clients */
+	M_BYTES_OUT,		/* to the clients */
+	M_FAIL_SPAWN,		/* couldn't run ssh */
+	M_FAIL_SSH,		/* ssh went away before being ready */
+	M_FAIL_FORWARD,		/* ssh ready but not forwarding */
+	M_FAIL_CONNECT,		/* gave up connecting a client */
+	M_FAIL_SPLICE,
+	M_FAIL_NOMEM,
+	M_NCOUNTERS
+};
+
+enum {
+	H_CONNECT,		/* accept to connected */
+	H_READY,		/* spawn to ready */
+	H_NHISTOGRAMS
+};
+
+#define NBUCKETS 12
+
+struct histogram {
+	unsigned long long	 buckets[NBUCKETS];
+	unsigned long long	 count;
+	double			 sum;
+};
+
+struct metrics {
+	unsigned long long	 counters[M_NCOUNTERS];
+	struct histogram	 histograms[H_NHISTOGRAMS];
+};
+
+/* one of the equivalent hosts to ssh into */
+struct dest {
+	char			*host;
+	struct estimate		 ready;		/* spawn to forwarding ready */
+	struct estimate		 rtt;		/* to connect through it */
+	int			 fails;
+	time_t			 down;		/* don't use until */
+};
+
+/* an ssh racing to be the one of an sshproc, see ssh_race */
+struct racer {
+	struct sshproc		*proc;
+	struct dest		*dest;
+	pid_t			 pid;
+	int			 fd;
+	int			 watch;
+	struct event		 ev;
+	char			 ctlpath[PATH_MAX];
+};
+
+/* one of the ssh processes of a tunnel */
+struct sshproc {
+	struct tunnel		*tunnel;
+	int			 idx;
+
+	/* what's passed to ssh -L */
+	char			 tflag[PATH_MAX + 256];
+
+	/* where to connect: host and port, or the socket path with -u */
+	char			 host[256];
+	char			 port[16];
+
+	char			 ctlpath[PATH_MAX];
+	char			 fwdpath[PATH_MAX];
+
+	/*
+	 * The ssh process and its connections, protected by lock.
+	 * See lstun.c for the details.
+	 */
+	pid_t			 pid;
+	pid_t			 adopted;	/* from the previous process */
+	int			 pidfd;		/* of the adopted, or -1 */
+	struct dest		*dest;
+	struct timespec		 spawned;
+	int			 spawning;	/* first time ready */
+	int			 connfails;	/* in a row */
+	struct event		 spawnev;
+	struct racer		 racers[MAXRACE];
+	int			 racing;	/* racers still running */
+	int			 raced;		/* pid won a race */
+	unsigned int		 raceseq;
+	int			 ready;
+	int			 ready_fd;
+	int			 ready_watch;
+	struct event		 readyev;
+	pid_t			 ctl_pid;
+	int			 fwd_want;
+	int			 fwd_have;
+	int			 conn;
+	int			 idle;
+	struct timespec		 giveup;	/* drop those waiting since */
+
+	/* load, see tunnel_load */
+	unsigned long long	 bytes;		/* since last sampled, atomic */
+	double			 rate;		/* bytes per second */
+	double			 cpu;		/* share of a core, or -1 */
+	unsigned long long	 ticks;		/* cpu time when last sampled */
+	int			 sampled;
+
+	struct event		 timeoutev;
+	struct addrcache	 cache;
+};
+
+/* see sockopt.c */
+struct sockopts {
+	int			 nodelay;
+	int			 keepalive;	/* idle secs, -1 for default */
+	int			 sndbuf;
+	int			 rcvbuf;
+	int			 lowat;		/* TCP_NOTSENT_LOWAT */
+};
+
+struct tunnel {
+	TAILQ_ENTRY(tunnel)	 entry;
+	char			*name;
+	char			*addr;		/* where to listen */
+	int			 backlog;
+	int			 deferaccept;
+	int			 fastopen;	/* queue length */
+	struct sockopts		 sockopts;
+	char			*sshaddr;	/* the -L argument */
+	struct dest		*dests;
+	int			 ndests;
+	char			**sshopts;	/* -o, then the profile */
+	int			 nsshopts;
+	char			*sshprofile;
+	int			 race;		/* at once, see -r */
+	char			*statefile;
+	struct timeval		 timeout;
+	int			 master;
+	int			 unixfwd;
+	int			 muxfwd;
+
+	/* where the master forwards the clients with -W */
+	char			 mux_host[256];
+	int			 mux_port;
+
+	char			 rundir[PATH_MAX];
+
+	struct sshproc		*procs;
+	int			 nprocs;	/* at most */
+	int			 conn;		/* protected by lock */
+	struct event		 loadev;
+
+	/* the clients waiting for ssh, see conn_park; under lock */
+	struct conn		*prober;	/* trying for them */
+	struct timeval		 retry;		/* before it tries again */
+	int			 drainwin;	/* may be connecting at once */
+	int			 draining;	/* connecting now */
+	int			 drainwait;	/* a worker waits for room */
+
+	struct event		 prespawnev;
+	struct timeval		 prespawnkeep;
+
+	struct adapt		 adapt;
+	struct metrics		 metrics;
+};
+
+TAILQ_HEAD(tunnels, tunnel);
+
+/* one direction of a connection spliced through a pipe */
+struct pipedir {
+	struct conn		*conn;
+	int			 from;
+	int			 to;
+	int			 pfd[2];
+	size_t			 len;	/* bytes sitting in the pipe */
+	struct event		 rev;
+	struct event		 wev;
+};
+
 struct conn {
+	/* kept with the conn in the pool */
+	SLIST_ENTRY(conn)	 entry;
+	struct worker		*worker;
+	struct bufferevent	*sourcebev;	/* libevent2 only */
+	struct bufferevent	*tobev;
+	struct pipedir		 sdir;		/* source -> to */
+	struct pipedir		 tdir;		/* to -> source */
+
+	/* the rest is cleared by conn_new */
+	struct tunnel		*tunnel;
+	struct sshproc		*proc;
+	struct origin		*origin;	/* see admit.c */
+	TAILQ_ENTRY(conn)	 wentry;
+	int			 waiting;
+	int			 released;	/* counted in draining */
 	int			 ntentative;
-	struct timeval		 retry;
-	struct event		 waitev;
+	struct timespec		 since;
+	struct timespec		 tried;		/* last attempt */
+
+	/* connecting, see connect.c */
+	int			 connecting;
+	struct addrcache	*cache;
+	struct sockaddr_storage	 addrs[MAXADDRS];
+	socklen_t		 addrlens[MAXADDRS];
+	int			 cacheidx[MAXADDRS];
+	unsigned int		 cachegen;
+	int			 naddrs;
+	int			 nextaddr;
+	int			 inflight;
+	int			 connerr;
+	int			 attempts[MAXADDRS];
+	struct event		 attemptev[MAXADDRS];
+	struct event		 staggerev;
+
+	/* control connection to the master, see mux.c */
+	int			 mux;
+	struct event		 muxev;
+	unsigned char		 muxbuf[512];	/* the request, then replies */
+	size_t			 muxlen;
+	size_t			 muxoff;	/* of the request, sent */
+	int			 muxfds;	/* to send */
+
 	int			 source;
-	struct bufferevent	*sourcebev;
 	int			 to;
-	struct bufferevent	*tobev;
+	int			 spliced;
+	size_t			 held;	/* in the bufferevents */
+	int			 paused;
+	struct event		 holdev;
+	struct uconn		*uconn;
 };
 
-int		conn_splice(struct conn *);
+/* admit.c */
+extern int	admit_max;
+extern int	admit_maxsource;
+extern int	admit_rate;
+
+long		admit_check(void);
+int		admit_conn(const struct sockaddr *, struct origin **);
+int		admit_release(struct origin *);
+
+/* connect.c */
+int		conn_connect(struct conn *, struct addrcache *, const char *,
+		    const char *);
+void		conn_connect_abort(struct conn *);
+void		connect_resolve(struct addrcache *, const char *,
+		    const char *);
+void		connect_log_stats(struct addrcache *, const char *);
+
+/* mux.c */
+int		mux_connect(struct conn *, const char *, const char *, int);
+void		mux_close(struct conn *);
+
+/* lstun.c */
+extern struct event_base *mainbase;
+extern struct tunnels	tunnels;
+extern struct worker	*workers;
+extern int		nworkers;
+
+struct tunnel	*tunnel_new(const char *);
+void		tunnel_add_dest(struct tunnel *, const char *);
+void		tunnel_add_sshopt(struct tunnel *, const char *);
+void		tunnel_status(struct tunnel *, int *, int *);
+void		conn_connected(struct conn *, int);
+void		conn_account(struct conn *, size_t, int);
 void		conn_free(struct conn *);
+
+/* metrics.c */
+void		metrics_add(struct tunnel *, int, unsigned long long);
+void		metrics_observe(struct tunnel *, int, double);
+void		metrics_listen(const char *);
+void		metrics_start(void);
+void		metrics_stop(void);
+void		metrics_close(void);
+int		metrics_sockets(const int **);
+
+/* restart.c */
+void		restart_inherit(void);
+int		restart_socket(const struct sockaddr *, socklen_t);
+void		restart_done(void);
+int		restart_exec(char **);
+int		restart_alive(struct sshproc *);
+int		restart_kill(struct sshproc *, int);
+void		restart_release(struct sshproc *);
+
+/* parse.c */
+void		parse_config(const char *);
+
+/* sockopt.c */
+int		sockopt_parse(struct sockopts *, const char *,
+		    const char **);
+int		sockopt_apply(const struct sockopts *, int, int);
+
+/* splice.c, splice_bev.c, splice_pipe.c, splice_uring.c */
+struct backend {
+	const char	*name;
+	int		 unixok;	/* can splice unix-domain sockets */
+	int		(*splice)(struct conn *);
+	void		(*unsplice)(struct conn *);
+	int		(*available)(void);	/* NULL if always */
+};
+
+extern const struct backend	*backend;
+extern const struct backend	 backend_bev;
+extern const struct backend	 backend_pipe;
+extern const struct backend	 backend_sosplice;
+extern const struct backend	 backend_uring;
+extern size_t			 bufmax;
+extern size_t			 bufmemmax;
+
+size_t		bufmem_charge(long);
+
+int		splice_select(const char *);
+int		conn_splice(struct conn *);
+void		conn_unsplice(struct conn *);
+
+/* adapt.c */
+void		estimate_add(struct estimate *, double);
+void		adapt_init(struct adapt *, const char *, time_t);
+void		adapt_arrival(struct adapt *, time_t);
+void		adapt_ready(struct adapt *, double);
+void		adapt_idle(struct adapt *, time_t);
+time_t		adapt_keep(struct adapt *, time_t);
+time_t		adapt_prespawn(struct adapt *, time_t, time_t *);
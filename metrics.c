@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Counters and latency histograms of every tunnel, served in the
+ * Prometheus text format over HTTP on a local socket (see -m.)  Any
+ * request gets the metrics, the path is ignored.
+ *
+ * The counters are bumped by the workers with relaxed atomics, some
+ * after every read, and are read the same way when scraped.  The
+ * histograms are updated under metrics_lock, which may be taken with
+ * the lock of lstun.c held but not the other way around.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lstun.h"
+
+#define MAXLISTEN	8
+#define SCRAPETIMEOUT	5	/* seconds */
+
+static pthread_mutex_t	 metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int		 listeners[MAXLISTEN];
+static int		 nlisteners;
+static const char	*sockpath;	/* to remove when done */
+static struct event	 listenev[MAXLISTEN];
+
+/* the upper bounds of the buckets but the last, in seconds */
+static const double bounds[NBUCKETS - 1] = {
+	0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+};
+
+/* those with the same name must be next to each other */
+static const struct {
+	const char	*name;
+	const char	*label;
+	const char	*help;
+} counters[M_NCOUNTERS] = {
+	[M_ACCEPTED] = { "lstun_accepted_total", NULL,
+	    "Clients accepted." },
+	[M_REJECTED] = { "lstun_rejected_total", NULL,
+	    "Clients accepted but turned away by the limits." },
+	[M_CONNECTED] = { "lstun_connected_total", NULL,
+	    "Clients connected through ssh." },
+	[M_RETRIES] = { "lstun_connect_retries_total", NULL,
+	    "Failed attempts to connect a client that were retried." },
+	[M_SPAWNS] = { "lstun_ssh_spawns_total", NULL,
+	    "ssh processes spawned." },
+	[M_BYTES_IN] = { "lstun_bytes_total", "direction=\"in\"",
+	    "Bytes moved between the clients and ssh." },
+	[M_BYTES_OUT] = { "lstun_bytes_total", "direction=\"out\"", NULL },
+	[M_FAIL_SPAWN] = { "lstun_failures_total", "cause=\"spawn\"",
+	    "Failures, by cause." },
+	[M_FAIL_SSH] = { "lstun_failures_total", "cause=\"ssh\"", NULL },
+	[M_FAIL_FORWARD] = { "lstun_failures_total", "cause=\"forward\"",
+	    NULL },
+	[M_FAIL_CONNECT] = { "lstun_failures_total", "cause=\"connect\"",
+	    NULL },
+	[M_FAIL_SPLICE] = { "lstun_failures_total", "cause=\"splice\"",
+	    NULL },
+	[M_FAIL_NOMEM] = { "lstun_failures_total", "cause=\"nomem\"",
+	    NULL },
+};
+
+static const struct {
+	const char	*name;
+	const char	*help;
+} histograms[H_NHISTOGRAMS] = {
+	[H_CONNECT] = { "lstun_connect_seconds",
+	    "Time from accepting a client to having it connected." },
+	[H_READY] = { "lstun_ssh_ready_seconds",
+	    "Time from spawning ssh to having the forwarding ready." },
+};
+
+struct scrape {
+	int		 fd;
+	char		 req[1024];
+	size_t		 len;
+	struct evbuffer	*buf;
+	struct event	 ev;
+};
+
+void
+metrics_add(struct tunnel *t, int c, unsigned long long n)
+{
+	__atomic_add_fetch(&t->metrics.counters[c], n, __ATOMIC_RELAXED);
+}
+
+void
+metrics_observe(struct tunnel *t, int h, double secs)
+{
+	struct histogram *hg = &t->metrics.histograms[h];
+	int i;
+
+	for (i = 0; i < NBUCKETS - 1; ++i)
+		if (secs <= bounds[i])
+			break;
+
+	pthread_mutex_lock(&metrics_lock);
+	hg->buckets[i]++;
+	hg->count++;
+	hg->sum += secs;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+ * Write the tunnel name as a label value, escaped.
+ */
+static void
+put_name(struct evbuffer *b, const char *name)
+{
+	evbuffer_add_printf(b, "tunnel=\"");
+	for (; *name != '\0'; ++name) {
+		if (*name == '"' || *name == '\\')
+			evbuffer_add_printf(b, "\\");
+		evbuffer_add(b, name, 1);
+	}
+	evbuffer_add_printf(b, "\"");
+}
+
+static void
+put_gauges(struct evbuffer *b)
+{
+	struct tunnel *t;
+	int conn, running;
+
+	evbuffer_add_printf(b, "# HELP lstun_connections Clients"
+	    " connected or waiting for ssh.\n"
+	    "# TYPE lstun_connections gauge\n");
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		tunnel_status(t, &conn, &running);
+		evbuffer_add_printf(b, "lstun_connections{");
+		put_name(b, t->name);
+		evbuffer_add_printf(b, "} %d\n", conn);
+	}
+
+	evbuffer_add_printf(b, "# HELP lstun_ssh_running ssh processes"
+	    " running.\n"
+	    "# TYPE lstun_ssh_running gauge\n");
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		tunnel_status(t, &conn, &running);
+		evbuffer_add_printf(b, "lstun_ssh_running{");
+		put_name(b, t->name);
+		evbuffer_add_printf(b, "} %d\n", running);
+	}
+}
+
+static void
+put_counters(struct evbuffer *b)
+{
+	struct tunnel *t;
+	int i;
+
+	for (i = 0; i < M_NCOUNTERS; ++i) {
+		if (counters[i].help != NULL)
+			evbuffer_add_printf(b, "# HELP %s %s\n# TYPE %s"
+			    " counter\n", counters[i].name, counters[i].help,
+			    counters[i].name);
+		TAILQ_FOREACH(t, &tunnels, entry) {
+			evbuffer_add_printf(b, "%s{", counters[i].name);
+			put_name(b, t->name);
+			if (counters[i].label != NULL)
+				evbuffer_add_printf(b, ",%s",
+				    counters[i].label);
+			evbuffer_add_printf(b, "} %llu\n",
+			    __atomic_load_n(&t->metrics.counters[i],
+			    __ATOMIC_RELAXED));
+		}
+	}
+}
+
+static void
+put_histograms(struct evbuffer *b)
+{
+	struct tunnel *t;
+	struct histogram *hg;
+	const char *name;
+	unsigned long long n;
+	int i, j;
+
+	for (i = 0; i < H_NHISTOGRAMS; ++i) {
+		name = histograms[i].name;
+		evbuffer_add_printf(b, "# HELP %s %s\n# TYPE %s histogram\n",
+		    name, histograms[i].help, name);
+		TAILQ_FOREACH(t, &tunnels, entry) {
+			hg = &t->metrics.histograms[i];
+			for (n = 0, j = 0; j < NBUCKETS; ++j) {
+				n += hg->buckets[j];
+				evbuffer_add_printf(b, "%s_bucket{", name);
+				put_name(b, t->name);
+				if (j == NBUCKETS - 1)
+					evbuffer_add_printf(b,
+					    ",le=\"+Inf\"} %llu\n", n);
+				else
+					evbuffer_add_printf(b,
+					    ",le=\"%g\"} %llu\n", bounds[j], n);
+			}
+			evbuffer_add_printf(b, "%s_sum{", name);
+			put_name(b, t->name);
+			evbuffer_add_printf(b, "} %f\n%s_count{", hg->sum,
+			    name);
+			put_name(b, t->name);
+			evbuffer_add_printf(b, "} %llu\n", hg->count);
+		}
+	}
+}
+
+static void
+scrape_free(struct scrape *sc)
+{
+	event_del(&sc->ev);
+	close(sc->fd);
+	if (sc->buf != NULL)
+		evbuffer_free(sc->buf);
+	free(sc);
+}
+
+static void
+scrape_write(int fd, short ev, void *d)
+{
+	struct scrape *sc = d;
+
+	if (ev & EV_TIMEOUT) {
+		scrape_free(sc);
+		return;
+	}
+
+	if (evbuffer_write(sc->buf, fd) == -1 && errno != EAGAIN) {
+		scrape_free(sc);
+		return;
+	}
+	if (evbuffer_get_length(sc->buf) == 0)
+		scrape_free(sc);
+}
+
+/*
+ * Wait for the whole request not to reset the connection by closing
+ * it with something still to read, then reply.
+ */
+static void
+scrape_read(int fd, short ev, void *d)
+{
+	struct scrape *sc = d;
+	struct evbuffer *body;
+	struct timeval tv;
+	ssize_t n;
+
+	if (ev & EV_TIMEOUT) {
+		scrape_free(sc);
+		return;
+	}
+
+	n = read(fd, sc->req + sc->len, sizeof(sc->req) - sc->len - 1);
+	if (n == -1 && errno == EAGAIN)
+		return;
+	if (n <= 0) {
+		scrape_free(sc);
+		return;
+	}
+	sc->len += n;
+	sc->req[sc->len] = '\0';
+	if (strstr(sc->req, "\r\n\r\n") == NULL &&
+	    strstr(sc->req, "\n\n") == NULL &&
+	    sc->len < sizeof(sc->req) - 1)
+		return;
+
+	if ((sc->buf = evbuffer_new()) == NULL ||
+	    (body = evbuffer_new()) == NULL) {
+		log_warn("evbuffer_new");
+		scrape_free(sc);
+		return;
+	}
+
+	put_gauges(body);
+	put_counters(body);
+	pthread_mutex_lock(&metrics_lock);
+	put_histograms(body);
+	pthread_mutex_unlock(&metrics_lock);
+
+	evbuffer_add_printf(sc->buf, "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n\r\n", evbuffer_get_length(body));
+	evbuffer_add_buffer(sc->buf, body);
+	evbuffer_free(body);
+
+	event_del(&sc->ev);
+	event_assign(&sc->ev, mainbase, fd, EV_WRITE|EV_PERSIST, scrape_write,
+	    sc);
+	timerclear(&tv);
+	tv.tv_sec = SCRAPETIMEOUT;
+	event_add(&sc->ev, &tv);
+}
+
+static void
+metrics_accept(int fd, short ev, void *d)
+{
+	struct scrape *sc;
+	struct timeval tv;
+	int s, flags;
+
+	if ((s = accept(fd, NULL, 0)) == -1) {
+		if (errno != EAGAIN && errno != ECONNABORTED)
+			log_warn("accept");
+		return;
+	}
+
+	if ((flags = fcntl(s, F_GETFL)) == -1 ||
+	    fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+		log_warn("fcntl");
+		close(s);
+		return;
+	}
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL) {
+		log_warn("calloc");
+		close(s);
+		return;
+	}
+	sc->fd = s;
+
+	event_assign(&sc->ev, mainbase, s, EV_READ|EV_PERSIST, scrape_read,
+	    sc);
+	timerclear(&tv);
+	tv.tv_sec = SCRAPETIMEOUT;
+	event_add(&sc->ev, &tv);
+}
+
+static void
+listen_fd(int s)
+{
+	int flags;
+
+	if (listen(s, 16) == -1)
+		fatal("listen");
+	if ((flags = fcntl(s, F_GETFL)) == -1 ||
+	    fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1)
+		fatal("fcntl");
+	listeners[nlisteners++] = s;
+}
+
+/*
+ * Bind the socket for the metrics: a path for a unix-domain socket,
+ * or [host:]port, where host defaults to localhost.
+ */
+void
+metrics_listen(const char *addr)
+{
+	struct addrinfo hints, *res, *res0;
+	struct sockaddr_un sun;
+	char host[256];
+	const char *c, *port;
+	int s, v, r;
+
+	if (*addr == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlcpy(sun.sun_path, addr, sizeof(sun.sun_path)) >=
+		    sizeof(sun.sun_path))
+			fatalx("path too long: %s", addr);
+
+		sockpath = addr;
+
+		/* handed over by the previous process, see restart.c */
+		if ((s = restart_socket((struct sockaddr *)&sun,
+		    sizeof(sun))) != -1) {
+			listen_fd(s);
+			return;
+		}
+
+		/* a leftover of a previous run */
+		unlink(addr);
+
+		if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			fatal("socket");
+		if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			fatal("bind %s", addr);
+		listen_fd(s);
+		return;
+	}
+
+	strlcpy(host, "localhost", sizeof(host));
+	port = addr;
+	if ((c = strrchr(addr, ':')) != NULL) {
+		if ((size_t)(c - addr) >= sizeof(host))
+			fatalx("name too long: %s", addr);
+		memcpy(host, addr, c - addr);
+		host[c - addr] = '\0';
+		port = c + 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((r = getaddrinfo(host, port, &hints, &res0)) != 0)
+		fatalx("getaddrinfo(%s): %s", addr, gai_strerror(r));
+
+	for (res = res0; res != NULL && nlisteners < MAXLISTEN;
+	    res = res->ai_next) {
+		if ((s = restart_socket(res->ai_addr, res->ai_addrlen)) != -1) {
+			listen_fd(s);
+			continue;
+		}
+
+		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (s == -1)
+			continue;
+		v = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &v,
+		    sizeof(v)) == -1)
+			fatal("setsockopt(SO_REUSEADDR)");
+		if (bind(s, res->ai_addr, res->ai_addrlen) == -1) {
+			close(s);
+			continue;
+		}
+		listen_fd(s);
+	}
+	freeaddrinfo(res0);
+
+	if (nlisteners == 0)
+		fatal("can't bind %s", addr);
+}
+
+/*
+ * Serve the metrics from the main event loop.
+ */
+void
+metrics_start(void)
+{
+	int i;
+
+	for (i = 0; i < nlisteners; ++i) {
+		event_assign(&listenev[i], mainbase, listeners[i],
+		    EV_READ|EV_PERSIST, metrics_accept, NULL);
+		event_add(&listenev[i], NULL);
+	}
+}
+
+/*
+ * Stop serving the metrics, the new process took over the sockets.
+ */
+void
+metrics_stop(void)
+{
+	int i;
+
+	for (i = 0; i < nlisteners; ++i) {
+		event_del(&listenev[i]);
+		close(listeners[i]);
+	}
+	nlisteners = 0;
+}
+
+/*
+ * Stop serving the metrics for good, on the way out.
+ */
+void
+metrics_close(void)
+{
+	metrics_stop();
+	if (sockpath != NULL)
+		unlink(sockpath);
+}
+
+int
+metrics_sockets(const int **fds)
+{
+	*fds = listeners;
+	return nlisteners;
+}
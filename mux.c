@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A minimal client for the OpenSSH multiplexing protocol (see
+ * PROTOCOL.mux in the OpenSSH sources.)  The client socket is passed
+ * to the master, which forwards it to host:port as ssh -W would do.
+ * The master then closes the control connection when the channel goes
+ * away, so it's kept open until EOF.
+ *
+ * The control socket is non-blocking from the start: the request is
+ * written as the master takes it, and only then are the replies read,
+ * so that a master that's stuck holds up only its own clients.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lstun.h"
+
+#define MUX_MSG_HELLO		0x00000001
+#define MUX_C_NEW_STDIO_FWD	0x10000008
+#define MUX_S_PERMISSION_DENIED	0x80000002
+#define MUX_S_FAILURE		0x80000003
+#define MUX_S_SESSION_OPENED	0x80000006
+
+#define SSHMUX_VER		4
+
+static void
+put_u32(unsigned char *buf, size_t *len, uint32_t v)
+{
+	buf[(*len)++] = v >> 24;
+	buf[(*len)++] = v >> 16;
+	buf[(*len)++] = v >> 8;
+	buf[(*len)++] = v;
+}
+
+static uint32_t
+get_u32(const unsigned char *buf)
+{
+	return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+	    (uint32_t)buf[2] << 8 | (uint32_t)buf[3];
+}
+
+static int
+put_string(unsigned char *buf, size_t *len, size_t size, const char *s)
+{
+	size_t l;
+
+	l = strlen(s);
+	if (*len + 4 + l > size)
+		return -1;
+	put_u32(buf, len, l);
+	memcpy(buf + *len, s, l);
+	*len += l;
+	return 0;
+}
+
+static int
+send_fd(int sock, int fd)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	char ch = '\0';
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	msg.msg_control = &cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	iov.iov_base = &ch;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (sendmsg(sock, &msg, 0) != 1)
+		return -1;
+	return 0;
+}
+
+static void
+mux_fail(struct conn *c)
+{
+	event_del(&c->muxev);
+	c->mux = 0;
+	close(c->to);
+	c->to = -1;
+	conn_connected(c, -1);
+}
+
+/*
+ * Handle a reply from the master.  Returns -1 if the request failed,
+ * 1 if the session was opened and 0 if it's something else.
+ */
+static int
+mux_dispatch(struct conn *c, const unsigned char *p, size_t len)
+{
+	uint32_t type, l;
+
+	if (len < 4)
+		return -1;
+
+	switch (type = get_u32(p)) {
+	case MUX_MSG_HELLO:
+		if (len < 8 || get_u32(p + 4) != SSHMUX_VER) {
+			log_warnx("unsupported ssh mux protocol version");
+			return -1;
+		}
+		return 0;
+	case MUX_S_SESSION_OPENED:
+		if (len < 8 || get_u32(p + 4) != (uint32_t)c->ntentative)
+			return 0;
+		return 1;
+	case MUX_S_PERMISSION_DENIED:
+	case MUX_S_FAILURE:
+		if (len < 8 || get_u32(p + 4) != (uint32_t)c->ntentative)
+			return 0;
+		if (len >= 12 && (l = get_u32(p + 8)) <= len - 12)
+			log_warnx("ssh mux: %s: %.*s",
+			    type == MUX_S_FAILURE ? "failure" :
+			    "permission denied", (int)l, p + 12);
+		else
+			log_warnx("ssh mux: request failed");
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+static void
+mux_read(int fd, short ev, void *d)
+{
+	struct conn *c = d;
+	size_t l;
+	ssize_t n;
+	int r;
+
+	n = read(fd, c->muxbuf + c->muxlen, sizeof(c->muxbuf) - c->muxlen);
+	if (n == -1 && errno == EAGAIN)
+		return;
+
+	if (n == -1 || n == 0) {
+		if (c->source != -1) {
+			if (n == -1)
+				log_warn("ssh mux");
+			mux_fail(c);
+			return;
+		}
+
+		log_info("closing connection (mux eof)");
+		conn_free(c);
+		return;
+	}
+
+	/* once the session is opened there's nothing else to do */
+	if (c->source == -1)
+		return;
+
+	c->muxlen += n;
+	while (c->muxlen >= 4) {
+		l = get_u32(c->muxbuf);
+		if (l > sizeof(c->muxbuf) - 4) {
+			log_warnx("ssh mux: message too long");
+			mux_fail(c);
+			return;
+		}
+		if (c->muxlen < l + 4)
+			break;
+
+		if ((r = mux_dispatch(c, c->muxbuf + 4, l)) == -1) {
+			mux_fail(c);
+			return;
+		}
+
+		c->muxlen -= l + 4;
+		memmove(c->muxbuf, c->muxbuf + l + 4, c->muxlen);
+
+		if (r == 1) {
+			/* the master has its own copy now */
+			close(c->source);
+			c->source = -1;
+			conn_connected(c, 0);
+			return;
+		}
+	}
+}
+
+/*
+ * Send what's left of the request and the client socket, twice.
+ * Returns 0 once done, 1 if it would block and -1 on failure.
+ */
+static int
+mux_send(struct conn *c)
+{
+	ssize_t n;
+
+	while (c->muxoff < c->muxlen) {
+		n = write(c->to, c->muxbuf + c->muxoff,
+		    c->muxlen - c->muxoff);
+		if (n == -1)
+			return errno == EAGAIN ? 1 : -1;
+		c->muxoff += n;
+	}
+
+	/* the same socket is both the stdin and the stdout */
+	while (c->muxfds > 0) {
+		if (send_fd(c->to, c->source) == -1)
+			return errno == EAGAIN ? 1 : -1;
+		c->muxfds--;
+	}
+	return 0;
+}
+
+static void
+mux_wait_reply(struct conn *c)
+{
+	c->muxlen = 0;
+	event_assign(&c->muxev, c->worker->base, c->to, EV_READ|EV_PERSIST,
+	    mux_read, c);
+	event_add(&c->muxev, NULL);
+}
+
+static void
+mux_write(int fd, short ev, void *d)
+{
+	struct conn *c = d;
+	socklen_t len;
+	int err;
+
+	/* the connect may have been in progress */
+	len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+	if (err != 0) {
+		log_debug("connect: %s", strerror(err));
+		mux_fail(c);
+		return;
+	}
+
+	switch (mux_send(c)) {
+	case -1:
+		log_warn("ssh mux");
+		mux_fail(c);
+		return;
+	case 1:
+		return;
+	}
+	event_del(&c->muxev);
+	mux_wait_reply(c);
+}
+
+/*
+ * Ask the master listening on path to forward c to host:port.  The
+ * outcome is reported via conn_connected; the connection is then
+ * released when the master closes the control connection.
+ */
+int
+mux_connect(struct conn *c, const char *path, const char *host, int port)
+{
+	struct sockaddr_un sun;
+	size_t len = 0, start;
+	int s, flags, r;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		log_warnx("path too long: %s", path);
+		return -1;
+	}
+
+	/* hello */
+	put_u32(c->muxbuf, &len, 8);
+	put_u32(c->muxbuf, &len, MUX_MSG_HELLO);
+	put_u32(c->muxbuf, &len, SSHMUX_VER);
+
+	/* new stdio forwarding: reserved, host, port */
+	start = len;
+	len += 4;
+	put_u32(c->muxbuf, &len, MUX_C_NEW_STDIO_FWD);
+	put_u32(c->muxbuf, &len, c->ntentative);
+	put_string(c->muxbuf, &len, sizeof(c->muxbuf), "");
+	if (put_string(c->muxbuf, &len, sizeof(c->muxbuf) - 4, host) == -1) {
+		log_warnx("host name too long: %s", host);
+		return -1;
+	}
+	put_u32(c->muxbuf, &len, port);
+	put_u32(c->muxbuf, &start, len - start - 4);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_warn("socket");
+		return -1;
+	}
+	if (sockopt_apply(&c->tunnel->sockopts, s, AF_UNIX) == -1)
+		log_debug("setsockopt: %s", strerror(errno));
+
+	if ((flags = fcntl(s, F_GETFL)) == -1 ||
+	    fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+		log_warn("fcntl");
+		close(s);
+		return -1;
+	}
+
+	/*
+	 * EAGAIN means that the backlog of the master is full: fail
+	 * and let the caller retry later as with any other error.
+	 */
+	if ((r = connect(s, (struct sockaddr *)&sun, sizeof(sun))) == -1 &&
+	    errno != EINPROGRESS) {
+		log_debug("connect: %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	c->to = s;
+	c->muxlen = len;
+	c->muxoff = 0;
+	c->muxfds = 2;
+
+	if (r == 0) {
+		switch (mux_send(c)) {
+		case -1:
+			log_warn("ssh mux");
+			close(s);
+			c->to = -1;
+			return -1;
+		case 0:
+			c->mux = 1;
+			mux_wait_reply(c);
+			return 0;
+		}
+	}
+
+	c->mux = 1;
+	event_assign(&c->muxev, c->worker->base, s, EV_WRITE|EV_PERSIST,
+	    mux_write, c);
+	event_add(&c->muxev, NULL);
+	return 0;
+}
+
+void
+mux_close(struct conn *c)
+{
+	if (c->mux) {
+		event_del(&c->muxev);
+		c->mux = 0;
+	}
+}
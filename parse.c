@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The configuration file: a list of tunnels, each with the same
+ * settings available on the command line.
+ *
+ *	tunnel NAME {
+ *		bind ADDR
+ *		backlog N
+ *		defer-accept
+ *		fastopen QLEN
+ *		sockopts OPTS	# see sockopt.c
+ *		forward SSHADDR
+ *		destination DEST	# one or more times
+ *		processes N
+ *		race N
+ *		ssh-option OPT	# one or more times
+ *		ssh-profile NAME
+ *		timeout SECS
+ *		state FILE
+ *		master
+ *		unix
+ *		stdio
+ *	}
+ *
+ * Words are separated by blanks or newlines, can be quoted with
+ * double quotes, and everything after a `#' is a comment.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "lstun.h"
+
+struct file {
+	const char	*path;
+	FILE		*fp;
+	int		 lineno;
+	char		 tok[1024];
+	int		 quoted;
+};
+
+/*
+ * Read the next token into f->tok.  Returns 0 at the end of file.
+ */
+static int
+next(struct file *f)
+{
+	size_t len = 0;
+	int ch;
+
+	f->quoted = 0;
+
+	for (;;) {
+		ch = getc(f->fp);
+		if (ch == '#')
+			while ((ch = getc(f->fp)) != '\n' && ch != EOF)
+				/* skip */;
+		if (ch == '\n')
+			f->lineno++;
+		if (ch == EOF)
+			return 0;
+		if (!isspace(ch))
+			break;
+	}
+
+	if (ch == '{' || ch == '}') {
+		f->tok[0] = ch;
+		f->tok[1] = '\0';
+		return 1;
+	}
+
+	if (ch == '"') {
+		f->quoted = 1;
+		while ((ch = getc(f->fp)) != '"') {
+			if (ch == EOF || ch == '\n')
+				fatalx("%s:%d: unterminated string", f->path,
+				    f->lineno);
+			if (len == sizeof(f->tok) - 1)
+				fatalx("%s:%d: string too long", f->path,
+				    f->lineno);
+			f->tok[len++] = ch;
+		}
+		f->tok[len] = '\0';
+		return 1;
+	}
+
+	do {
+		if (len == sizeof(f->tok) - 1)
+			fatalx("%s:%d: word too long", f->path, f->lineno);
+		f->tok[len++] = ch;
+		ch = getc(f->fp);
+	} while (ch != EOF && !isspace(ch) && ch != '{' && ch != '}' &&
+	    ch != '#' && ch != '"');
+	ungetc(ch, f->fp);
+	f->tok[len] = '\0';
+	return 1;
+}
+
+static int
+is(struct file *f, const char *word)
+{
+	return !f->quoted && !strcmp(f->tok, word);
+}
+
+static char *
+arg(struct file *f, const char *opt)
+{
+	char *s;
+
+	if (!next(f) || is(f, "{") || is(f, "}"))
+		fatalx("%s:%d: missing argument for %s", f->path, f->lineno,
+		    opt);
+	if ((s = strdup(f->tok)) == NULL)
+		fatal("strdup");
+	return s;
+}
+
+static void
+parse_tunnel(struct file *f)
+{
+	struct tunnel *t;
+	const char *errstr;
+	char *s;
+
+	if (!next(f) || is(f, "{") || is(f, "}"))
+		fatalx("%s:%d: missing tunnel name", f->path, f->lineno);
+
+	TAILQ_FOREACH(t, &tunnels, entry)
+		if (!strcmp(t->name, f->tok))
+			fatalx("%s:%d: tunnel %s defined twice", f->path,
+			    f->lineno, f->tok);
+	t = tunnel_new(f->tok);
+
+	if (!next(f) || !is(f, "{"))
+		fatalx("%s:%d: expected `{'", f->path, f->lineno);
+
+	for (;;) {
+		if (!next(f))
+			fatalx("%s:%d: missing `}'", f->path, f->lineno);
+		if (is(f, "}"))
+			return;
+
+		if (is(f, "bind"))
+			t->addr = arg(f, "bind");
+		else if (is(f, "backlog")) {
+			s = arg(f, "backlog");
+			t->backlog = strtonum(s, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("%s:%d: backlog is %s: %s", f->path,
+				    f->lineno, errstr, s);
+			free(s);
+		} else if (is(f, "defer-accept"))
+			t->deferaccept = 1;
+		else if (is(f, "fastopen")) {
+			s = arg(f, "fastopen");
+			t->fastopen = strtonum(s, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("%s:%d: fast open queue is %s: %s",
+				    f->path, f->lineno, errstr, s);
+			free(s);
+		} else if (is(f, "sockopts")) {
+			s = arg(f, "sockopts");
+			if (sockopt_parse(&t->sockopts, s, &errstr) == -1)
+				fatalx("%s:%d: socket options %s: %s",
+				    f->path, f->lineno, errstr, s);
+			free(s);
+		} else if (is(f, "forward"))
+			t->sshaddr = arg(f, "forward");
+		else if (is(f, "destination")) {
+			s = arg(f, "destination");
+			tunnel_add_dest(t, s);
+			free(s);
+		} else if (is(f, "processes")) {
+			s = arg(f, "processes");
+			t->nprocs = strtonum(s, 1, MAXPROCS, &errstr);
+			if (errstr != NULL)
+				fatalx("%s:%d: number of ssh is %s: %s",
+				    f->path, f->lineno, errstr, s);
+			free(s);
+		} else if (is(f, "race")) {
+			s = arg(f, "race");
+			t->race = strtonum(s, 1, MAXRACE, &errstr);
+			if (errstr != NULL)
+				fatalx("%s:%d: number of destinations to race"
+				    " is %s: %s", f->path, f->lineno, errstr,
+				    s);
+			free(s);
+		} else if (is(f, "ssh-option")) {
+			s = arg(f, "ssh-option");
+			tunnel_add_sshopt(t, s);
+			free(s);
+		} else if (is(f, "ssh-profile"))
+			t->sshprofile = arg(f, "ssh-profile");
+		else if (is(f, "state"))
+			t->statefile = arg(f, "state");
+		else if (is(f, "timeout")) {
+			s = arg(f, "timeout");
+			t->timeout.tv_sec = strtonum(s, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				fatalx("%s:%d: timeout is %s: %s", f->path,
+				    f->lineno, errstr, s);
+			free(s);
+		} else if (is(f, "master"))
+			t->master = 1;
+		else if (is(f, "unix"))
+			t->unixfwd = 1;
+		else if (is(f, "stdio"))
+			t->muxfwd = 1;
+		else
+			fatalx("%s:%d: unknown option: %s", f->path,
+			    f->lineno, f->tok);
+	}
+}
+
+void
+parse_config(const char *path)
+{
+	struct file f;
+
+	memset(&f, 0, sizeof(f));
+	f.path = path;
+	f.lineno = 1;
+	if ((f.fp = fopen(path, "r")) == NULL)
+		fatal("can't open %s", path);
+
+	while (next(&f)) {
+		if (!is(&f, "tunnel"))
+			fatalx("%s:%d: expected `tunnel', got %s", path,
+			    f.lineno, f.tok);
+		parse_tunnel(&f);
+	}
+
+	fclose(f.fp);
+}
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Restart without downtime.  The running process re-executes itself
+ * with the listening sockets moved to fd 3 onwards and describes
+ * what it's handing over in a pipe at fd 3, named by LSTUN_RESTART:
+ *
+ *	notify FD
+ *	listen FD				# one per socket
+ *	tunnel SSHADDR MASTER UNIX STDIO RUNDIR NAME
+ *	pidfd FD				# of the next ssh, if any
+ *	ssh IDX PID READY FWD RACED HOST	# one per ssh running
+ *
+ * The new process reads the configuration as usual, picks the
+ * sockets by address instead of binding them again, and takes over
+ * the ssh of the tunnels whose forwarding didn't change; the others
+ * are terminated.  Once it's ready it writes "ok" to the notify pipe
+ * and the old process stops accepting and drains its connections.
+ *
+ * The ssh taken over aren't children of the new process: once the old
+ * one exits they're reaped by init and their pid may be reused.  So
+ * they're watched and signalled through the pidfd passed along, or,
+ * where there's none, only the masters are taken over and watched
+ * through their control socket.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lstun.h"
+
+extern char	**environ;
+
+struct inherited {
+	int			 fd;
+	struct sockaddr_storage	 ss;
+	socklen_t		 len;
+};
+
+static struct inherited	*socks;
+static int		 nsocks;
+struct stale {
+	pid_t			 pid;
+	int			 pidfd;
+};
+
+static struct stale	*stale;		/* ssh not taken over */
+static int		 nstale;
+static int		 notify = -1;
+static int		 nextpidfd = -1;
+
+static int
+sockaddr_eq(const struct sockaddr *a, const struct sockaddr *b)
+{
+	const struct sockaddr_in *a4, *b4;
+	const struct sockaddr_in6 *a6, *b6;
+	const struct sockaddr_un *au, *bu;
+
+	if (a->sa_family != b->sa_family)
+		return 0;
+
+	switch (a->sa_family) {
+	case AF_INET:
+		a4 = (const struct sockaddr_in *)a;
+		b4 = (const struct sockaddr_in *)b;
+		return a4->sin_port == b4->sin_port &&
+		    a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	case AF_INET6:
+		a6 = (const struct sockaddr_in6 *)a;
+		b6 = (const struct sockaddr_in6 *)b;
+		return a6->sin6_port == b6->sin6_port &&
+		    a6->sin6_scope_id == b6->sin6_scope_id &&
+		    !memcmp(&a6->sin6_addr, &b6->sin6_addr,
+		    sizeof(a6->sin6_addr));
+	case AF_UNIX:
+		au = (const struct sockaddr_un *)a;
+		bu = (const struct sockaddr_un *)b;
+		return !strcmp(au->sun_path, bu->sun_path);
+	default:
+		return 0;
+	}
+}
+
+static void
+inherit_socket(int fd)
+{
+	struct inherited *s;
+
+	s = reallocarray(socks, nsocks + 1, sizeof(*socks));
+	if (s == NULL)
+		fatal("reallocarray");
+	socks = s;
+
+	s = &socks[nsocks];
+	memset(s, 0, sizeof(*s));
+	s->len = sizeof(s->ss);
+	if (getsockname(fd, (struct sockaddr *)&s->ss, &s->len) == -1) {
+		log_warn("getsockname");
+		close(fd);
+		return;
+	}
+	s->fd = fd;
+	nsocks++;
+}
+
+/*
+ * Parse the tunnel line and return the tunnel if its ssh can be
+ * taken over, or NULL.
+ */
+static struct tunnel *
+inherit_tunnel(char *s)
+{
+	struct tunnel *t;
+	char *sshaddr, *rundir;
+	int master, unixfwd, muxfwd, n;
+
+	if ((sshaddr = strsep(&s, " ")) == NULL || s == NULL ||
+	    sscanf(s, "%d %d %d %n", &master, &unixfwd, &muxfwd, &n) != 3)
+		return NULL;
+	s += n;
+	if ((rundir = strsep(&s, " ")) == NULL || s == NULL)
+		return NULL;
+
+	/* what's left is the name */
+	TAILQ_FOREACH(t, &tunnels, entry)
+		if (!strcmp(t->name, s))
+			break;
+	if (t == NULL)
+		return NULL;
+
+	if (strcmp(t->sshaddr, sshaddr) != 0 || t->master != master ||
+	    t->unixfwd != unixfwd || t->muxfwd != muxfwd) {
+		log_info("%s: forwarding changed, not taking over its ssh",
+		    t->name);
+		return NULL;
+	}
+
+	if (strcmp(rundir, "-") != 0 &&
+	    strlcpy(t->rundir, rundir, sizeof(t->rundir)) >=
+	    sizeof(t->rundir))
+		fatalx("path too long: %s", rundir);
+	return t;
+}
+
+static void
+inherit_ssh(struct tunnel *t, char *s)
+{
+	struct sshproc *p;
+	struct dest *d = NULL;
+	struct stale *v;
+	int idx, pid, ready, fwd, raced, pidfd, n, i;
+
+	pidfd = nextpidfd;
+	nextpidfd = -1;
+
+	if (sscanf(s, "%d %d %d %d %d %n", &idx, &pid, &ready, &fwd, &raced,
+	    &n) != 5 || pid <= 0) {
+		if (pidfd != -1)
+			close(pidfd);
+		return;
+	}
+	s += n;
+
+	if (t != NULL && idx >= 0 && idx < t->nprocs) {
+		for (i = 0; i < t->ndests; ++i)
+			if (!strcmp(t->dests[i].host, s))
+				d = &t->dests[i];
+	}
+
+	/* without a pidfd only a master can be told apart */
+	if (d == NULL || (pidfd == -1 && !t->master && !raced)) {
+		v = reallocarray(stale, nstale + 1, sizeof(*stale));
+		if (v == NULL)
+			fatal("reallocarray");
+		stale = v;
+		stale[nstale].pid = pid;
+		stale[nstale++].pidfd = pidfd;
+		return;
+	}
+
+	p = &t->procs[idx];
+	p->pid = p->adopted = pid;
+	p->pidfd = pidfd;
+	p->dest = d;
+	p->ready = ready;
+	p->fwd_want = p->fwd_have = fwd;
+	p->raced = raced;
+	clock_gettime(CLOCK_MONOTONIC, &p->spawned);
+
+	/* so that its termination gets scheduled */
+	p->idle = 1;
+
+	log_debug("%s: taking over ssh %d (%d) to %s", t->name, idx, pid,
+	    d->host);
+}
+
+/*
+ * Load what the previous process handed over, if any.  Called after
+ * the tunnels are set up but before binding the sockets.
+ */
+void
+restart_inherit(void)
+{
+	FILE *fp;
+	struct tunnel *t = NULL;
+	const char *errstr;
+	char *s, line[LINE_MAX];
+	int fd;
+
+	if ((s = getenv("LSTUN_RESTART")) == NULL)
+		return;
+	fd = strtonum(s, 3, INT_MAX, &errstr);
+	if (errstr != NULL)
+		fatalx("LSTUN_RESTART is %s: %s", errstr, s);
+	unsetenv("LSTUN_RESTART");
+
+	if ((fp = fdopen(fd, "r")) == NULL)
+		fatal("fdopen");
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+
+		if (sscanf(line, "notify %d", &fd) == 1)
+			notify = fd;
+		else if (sscanf(line, "listen %d", &fd) == 1)
+			inherit_socket(fd);
+		else if (sscanf(line, "pidfd %d", &fd) == 1)
+			nextpidfd = fd;
+		else if (!strncmp(line, "tunnel ", 7))
+			t = inherit_tunnel(line + 7);
+		else if (!strncmp(line, "ssh ", 4))
+			inherit_ssh(t, line + 4);
+	}
+
+	fclose(fp);
+}
+
+/*
+ * Return the socket bound to sa by the previous process, or -1.
+ */
+int
+restart_socket(const struct sockaddr *sa, socklen_t len)
+{
+	int i, fd;
+
+	for (i = 0; i < nsocks; ++i) {
+		if (socks[i].fd == -1 ||
+		    !sockaddr_eq((struct sockaddr *)&socks[i].ss, sa))
+			continue;
+		fd = socks[i].fd;
+		socks[i].fd = -1;
+		return fd;
+	}
+	return -1;
+}
+
+/*
+ * Drop what wasn't taken over and tell the previous process that
+ * it's done.
+ */
+void
+restart_done(void)
+{
+	int i;
+
+	if (notify == -1)
+		return;
+
+	for (i = 0; i < nsocks; ++i)
+		if (socks[i].fd != -1)
+			close(socks[i].fd);
+	/* still children of the previous process, which is waiting */
+	for (i = 0; i < nstale; ++i) {
+#if HAVE_PIDFD
+		if (stale[i].pidfd != -1) {
+			syscall(__NR_pidfd_send_signal, stale[i].pidfd,
+			    SIGTERM, NULL, 0);
+			close(stale[i].pidfd);
+			continue;
+		}
+#endif
+		kill(stale[i].pid, SIGTERM);
+	}
+	free(socks);
+	free(stale);
+
+	if (write(notify, "ok", 2) == -1)
+		log_warn("can't notify the previous process");
+	close(notify);
+	notify = -1;
+
+	log_info("took over from the previous process");
+}
+
+/*
+ * Whether the ssh taken over by p is still running.
+ */
+int
+restart_alive(struct sshproc *p)
+{
+	struct sockaddr_un sun;
+	int s, r, flags;
+
+#if HAVE_PIDFD
+	struct pollfd pfd;
+
+	/* readable once it exits */
+	if (p->pidfd != -1) {
+		pfd.fd = p->pidfd;
+		pfd.events = POLLIN;
+		return poll(&pfd, 1, 0) != 1;
+	}
+#endif
+
+	/* a master: its control socket is there while it runs */
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, p->ctlpath, sizeof(sun.sun_path));
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return 1;
+	if ((flags = fcntl(s, F_GETFL)) == -1 ||
+	    fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+		close(s);
+		return 1;
+	}
+	r = connect(s, (struct sockaddr *)&sun, sizeof(sun)) == 0 ||
+	    errno == EAGAIN || errno == EINPROGRESS;
+	close(s);
+	return r;
+}
+
+/*
+ * Send sig to the ssh taken over by p.  Fails with ENOSYS if it can
+ * be done only through its control socket.
+ */
+int
+restart_kill(struct sshproc *p, int sig)
+{
+#if HAVE_PIDFD
+	if (p->pidfd != -1)
+		return syscall(__NR_pidfd_send_signal, p->pidfd, sig, NULL,
+		    0);
+#endif
+	errno = ENOSYS;
+	return -1;
+}
+
+/*
+ * Forget about the ssh taken over by p, it's gone.
+ */
+void
+restart_release(struct sshproc *p)
+{
+	if (p->pidfd != -1) {
+		close(p->pidfd);
+		p->pidfd = -1;
+	}
+	p->adopted = 0;
+}
+
+/*
+ * Return a pidfd for the ssh of p, to be closed, or -1.
+ */
+static int
+ssh_pidfd(struct sshproc *p)
+{
+#if HAVE_PIDFD
+	/* ours, or handed over to us with one */
+	if (p->adopted != p->pid)
+		return syscall(__NR_pidfd_open, p->pid, 0);
+	if (p->pidfd != -1)
+		return dup(p->pidfd);
+#endif
+	return -1;
+}
+
+/*
+ * Re-execute lstun as the new process.  Returns the pipe where it
+ * tells when it's ready, or -1 on failure.  Called with lock held.
+ */
+int
+restart_exec(char **argv)
+{
+	struct tunnel *t;
+	struct sshproc *p;
+	struct worker *w;
+	struct evbuffer *buf = NULL;
+	const int *mfds;
+	char **env = NULL;
+	sigset_t set;
+	pid_t pid;
+	int *fds = NULL, *tmp = NULL, nfds, npidfds = 0, nm, high, i, j;
+	int pidfd, state[2] = { -1, -1 }, done[2] = { -1, -1 };
+
+	/* the state pipe, the notify pipe, the listeners and the ssh */
+	nm = metrics_sockets(&mfds);
+	nfds = 2 + nm;
+	for (i = 0; i < nworkers; ++i)
+		nfds += workers[i].nlisteners;
+	TAILQ_FOREACH(t, &tunnels, entry)
+		nfds += t->nprocs;
+
+	for (i = 0; environ[i] != NULL; ++i)
+		/* count */;
+	if ((fds = calloc(nfds, sizeof(*fds))) == NULL ||
+	    (tmp = calloc(nfds, sizeof(*tmp))) == NULL ||
+	    (env = calloc(i + 2, sizeof(*env))) == NULL ||
+	    (buf = evbuffer_new()) == NULL) {
+		log_warn("calloc");
+		goto err;
+	}
+	memcpy(env, environ, i * sizeof(*env));
+	env[i] = "LSTUN_RESTART=3";
+
+	if (pipe(state) == -1 || pipe(done) == -1) {
+		log_warn("pipe");
+		goto err;
+	}
+
+	nfds = 0;
+	fds[nfds++] = state[0];
+	fds[nfds++] = done[1];
+	evbuffer_add_printf(buf, "notify %d\n", 4);
+	for (i = 0; i < nworkers; ++i) {
+		w = &workers[i];
+		for (j = 0; j < w->nlisteners; ++j) {
+			if (w->listeners[j].fd == -1)
+				continue;
+			evbuffer_add_printf(buf, "listen %d\n", 3 + nfds);
+			fds[nfds++] = w->listeners[j].fd;
+		}
+	}
+	for (i = 0; i < nm; ++i) {
+		evbuffer_add_printf(buf, "listen %d\n", 3 + nfds);
+		fds[nfds++] = mfds[i];
+	}
+
+	TAILQ_FOREACH(t, &tunnels, entry) {
+		evbuffer_add_printf(buf, "tunnel %s %d %d %d %s %s\n",
+		    t->sshaddr, t->master, t->unixfwd, t->muxfwd,
+		    *t->rundir != '\0' ? t->rundir : "-", t->name);
+		for (i = 0; i < t->nprocs; ++i) {
+			p = &t->procs[i];
+			if (p->pid == -1)
+				continue;
+			if ((pidfd = ssh_pidfd(p)) != -1) {
+				evbuffer_add_printf(buf, "pidfd %d\n",
+				    3 + nfds);
+				fds[nfds++] = pidfd;
+				npidfds++;
+			}
+			evbuffer_add_printf(buf, "ssh %d %d %d %d %d %s\n", i,
+			    (int)p->pid, p->ready, p->fwd_have, p->raced,
+			    p->dest->host);
+		}
+	}
+
+	/* where to move them in the child without clobbering any */
+	high = 3 + nfds;
+	for (i = 0; i < nfds; ++i)
+		if (fds[i] >= high)
+			high = fds[i] + 1;
+
+	switch (pid = fork()) {
+	case -1:
+		log_warn("fork");
+		goto err;
+	case 0:
+		for (i = 0; i < nfds; ++i)
+			if ((tmp[i] = fcntl(fds[i], F_DUPFD, high)) == -1)
+				_exit(1);
+		for (i = 0; i < nfds; ++i)
+			if (dup2(tmp[i], 3 + i) == -1)
+				_exit(1);
+		closefrom(3 + nfds);
+
+		/* the workers run with all the signals blocked */
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+
+		environ = env;
+		execvp(argv[0], argv);
+		fatal("exec %s", argv[0]);
+	}
+
+	close(state[0]);
+	close(done[1]);
+	for (i = nfds - npidfds; i < nfds; ++i)
+		close(fds[i]);
+	while (evbuffer_get_length(buf) != 0)
+		if (evbuffer_write(buf, state[1]) == -1 && errno != EINTR)
+			break;
+	close(state[1]);
+
+	log_debug("started the new process (%d)", (int)pid);
+	evbuffer_free(buf);
+	free(env);
+	free(tmp);
+	free(fds);
+	return done[0];
+
+err:
+	for (i = nfds - npidfds; i < nfds; ++i)
+		close(fds[i]);
+	for (i = 0; i < 2; ++i) {
+		if (state[i] != -1)
+			close(state[i]);
+		if (done[i] != -1)
+			close(done[i]);
+	}
+	if (buf != NULL)
+		evbuffer_free(buf);
+	free(env);
+	free(tmp);
+	free(fds);
+	return -1;
+}
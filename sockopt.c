@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Socket options for both ends of the connections of a tunnel, given
+ * as a comma-separated list of
+ *
+ *	interactive		nodelay,notsent-lowat=16
+ *	bulk			sndbuf=4096,rcvbuf=4096
+ *	nodelay
+ *	keepalive[=SECS]	with SECS of idle time before the probes
+ *	sndbuf=KB
+ *	rcvbuf=KB
+ *	notsent-lowat=KB
+ *
+ * where the later ones override the earlier.  They are set on the
+ * listening sockets, whose options are inherited by the accepted
+ * ones, and on the sockets connecting to ssh before the connect so
+ * that the buffer sizes are taken into account for the TCP window.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "lstun.h"
+
+static int
+kbytes(const char *s, const char **errstr)
+{
+	return strtonum(s, 1, INT_MAX / 1024, errstr) * 1024;
+}
+
+/*
+ * Parse the options in str into o.  Returns -1 and sets *errstr if
+ * one is unknown, has a bad value or isn't available on this system.
+ */
+int
+sockopt_parse(struct sockopts *o, const char *str, const char **errstr)
+{
+	char *s, *t, *opt, *val;
+	int r = -1;
+
+	if ((s = strdup(str)) == NULL)
+		fatal("strdup");
+
+	*errstr = NULL;
+	for (t = s; (opt = strsep(&t, ",")) != NULL; ) {
+		if ((val = strchr(opt, '=')) != NULL)
+			*val++ = '\0';
+
+		if (!strcmp(opt, "interactive") && val == NULL) {
+			o->nodelay = 1;
+			o->lowat = 16 * 1024;
+		} else if (!strcmp(opt, "bulk") && val == NULL) {
+			o->sndbuf = 4096 * 1024;
+			o->rcvbuf = 4096 * 1024;
+		} else if (!strcmp(opt, "nodelay") && val == NULL)
+			o->nodelay = 1;
+		else if (!strcmp(opt, "keepalive")) {
+			o->keepalive = -1;
+			if (val != NULL)
+				o->keepalive = strtonum(val, 1, INT_MAX,
+				    errstr);
+		} else if (!strcmp(opt, "sndbuf") && val != NULL)
+			o->sndbuf = kbytes(val, errstr);
+		else if (!strcmp(opt, "rcvbuf") && val != NULL)
+			o->rcvbuf = kbytes(val, errstr);
+		else if (!strcmp(opt, "notsent-lowat") && val != NULL)
+			o->lowat = kbytes(val, errstr);
+		else {
+			*errstr = "unknown";
+			goto done;
+		}
+		if (*errstr != NULL)
+			goto done;
+	}
+
+#ifndef TCP_NOTSENT_LOWAT
+	if (o->lowat != 0) {
+		*errstr = "notsent-lowat not available";
+		goto done;
+	}
+#endif
+#ifndef TCP_KEEPIDLE
+	if (o->keepalive > 0) {
+		*errstr = "keepalive idle time not available";
+		goto done;
+	}
+#endif
+	r = 0;
+
+ done:
+	free(s);
+	return r;
+}
+
+/*
+ * Set o on the socket s of the given family.  Returns -1 on failure,
+ * having set as many as possible.
+ */
+int
+sockopt_apply(const struct sockopts *o, int s, int family)
+{
+	int r = 0, v;
+
+	if (o->sndbuf != 0 && setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+	    &o->sndbuf, sizeof(o->sndbuf)) == -1)
+		r = -1;
+	if (o->rcvbuf != 0 && setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+	    &o->rcvbuf, sizeof(o->rcvbuf)) == -1)
+		r = -1;
+
+	/* the rest only makes sense for TCP */
+	if (family != AF_INET && family != AF_INET6)
+		return r;
+
+	v = 1;
+	if (o->nodelay && setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &v,
+	    sizeof(v)) == -1)
+		r = -1;
+	if (o->keepalive != 0 && setsockopt(s, SOL_SOCKET, SO_KEEPALIVE,
+	    &v, sizeof(v)) == -1)
+		r = -1;
+#ifdef TCP_KEEPIDLE
+	if (o->keepalive > 0 && setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE,
+	    &o->keepalive, sizeof(o->keepalive)) == -1)
+		r = -1;
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	if (o->lowat != 0 && setsockopt(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+	    &o->lowat, sizeof(o->lowat)) == -1)
+		r = -1;
+#endif
+	return r;
+}
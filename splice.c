@@ -16,13 +16,18 @@
 
 #include "config.h"
 
-#if HAVE_SO_SPLICE
-
+#include <sys/queue.h>
 #include <sys/socket.h>
 
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
 #include "log.h"
 #include "lstun.h"
 
+#if HAVE_SO_SPLICE
+
 static void
 splice_done(int fd, short ev, void *data)
 {
@@ -32,8 +37,8 @@ splice_done(int fd, short ev, void *data)
 	conn_free(c);
 }
 
-int
-conn_splice(struct conn *c)
+static int
+sosplice_splice(struct conn *c)
 {
 	if (setsockopt(c->source, SOL_SOCKET, SO_SPLICE, &c->to, sizeof(int))
 	    == -1)
@@ -42,8 +47,78 @@ conn_splice(struct conn *c)
 	    == -1)
 		return -1;
 
-	event_once(c->source, EV_READ, splice_done, c, NULL);
+	event_base_once(c->worker->base, c->source, EV_READ, splice_done, c,
+	    NULL);
 	return 0;
 }
 
+static void
+sosplice_unsplice(struct conn *c)
+{
+	/* closing the sockets is enough to tear down the splice */
+	return;
+}
+
+/* TCP and unix-domain sockets can't be spliced together */
+const struct backend backend_sosplice = {
+	"sosplice", 0, sosplice_splice, sosplice_unsplice, NULL
+};
+
 #endif	/* HAVE_SO_SPLICE */
+
+/* those available, the fastest first */
+static const struct backend *backends[] = {
+#if HAVE_SO_SPLICE
+	&backend_sosplice,
+#endif
+#if HAVE_SPLICE
+	&backend_pipe,
+#endif
+#if HAVE_IO_URING
+	&backend_uring,
+#endif
+	&backend_bev,
+};
+
+const struct backend *backend;
+
+/*
+ * Move the data with the backend called name, or the fastest one if
+ * NULL.  Returns -1 if it's not available.  Some depend on what the
+ * running kernel allows, not only on what was there at build time.
+ */
+int
+splice_select(const char *name)
+{
+	const struct backend *b;
+	size_t i;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+		b = backends[i];
+		if (name != NULL && strcmp(b->name, name))
+			continue;
+		if (b->available != NULL && !b->available()) {
+			if (name != NULL)
+				return -1;
+			continue;
+		}
+		backend = b;
+		return 0;
+	}
+	return -1;
+}
+
+int
+conn_splice(struct conn *c)
+{
+	/* even if it fails halfway, unsplice cleans up */
+	c->spliced = 1;
+	return backend->splice(c);
+}
+
+void
+conn_unsplice(struct conn *c)
+{
+	if (c->spliced)
+		backend->unsplice(c);
+}
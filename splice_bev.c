@@ -16,17 +16,122 @@
 
 #include "config.h"
 
-#if !HAVE_SO_SPLICE
-
+#include <sys/queue.h>
 #include <sys/socket.h>
 
+#include <limits.h>
+#include <time.h>
+
 #include "log.h"
 #include "lstun.h"
 
+/*
+ * Every direction of a connection buffers at most bufmax bytes: once
+ * the output towards one side is that full we stop reading from the
+ * other until it drains to half of it, so a slow peer pushes back on
+ * the fast one instead of growing the buffers.  On top of that all
+ * the connections together may not hold more than bufmemmax bytes;
+ * over it they stop reading and try again every BUFRETRY.
+ */
+#define BUFRETRY	50	/* msec */
+
+size_t			 bufmax = BUFMAX;
+size_t			 bufmemmax = BUFMEMMAX;
+
+static size_t		 bufmem;	/* held by all the connections */
+
+#define BEV_IOSIZE	(64 * 1024)
+
+#define PAUSE_SOURCE	0x1
+#define PAUSE_TO	0x2
+
+/*
+ * Add delta to the memory held by all the connections, also by those
+ * of the uring backend, and return the new total.  It's shared by the
+ * workers but only a budget: a relaxed atomic is enough.
+ */
+size_t
+bufmem_charge(long delta)
+{
+	if (delta == 0)
+		return __atomic_load_n(&bufmem, __ATOMIC_RELAXED);
+	return __atomic_add_fetch(&bufmem, (size_t)delta, __ATOMIC_RELAXED);
+}
+
 static void
-nopcb(struct bufferevent *bev, void *d)
+bev_pause(struct conn *c, struct bufferevent *bev, int flag, int pause)
 {
-	return;
+	if (pause && !(c->paused & flag)) {
+		bufferevent_disable(bev, EV_READ);
+		c->paused |= flag;
+	} else if (!pause && (c->paused & flag)) {
+		bufferevent_enable(bev, EV_READ);
+		c->paused &= ~flag;
+	}
+}
+
+/*
+ * Account what c is holding now and stop or resume reading from each
+ * side depending on how much room is left.
+ */
+static void
+bev_throttle(struct conn *c)
+{
+	struct timeval tv;
+	size_t sout, tout, held, total;
+	int full;
+
+	sout = evbuffer_get_length(bufferevent_get_output(c->sourcebev));
+	tout = evbuffer_get_length(bufferevent_get_output(c->tobev));
+	held = sout + tout;
+
+	total = bufmem_charge((long)held - (long)c->held);
+	c->held = held;
+
+	full = bufmemmax != 0 && total >= bufmemmax;
+	bev_pause(c, c->sourcebev, PAUSE_SOURCE, full || tout >= bufmax);
+	bev_pause(c, c->tobev, PAUSE_TO, full || sout >= bufmax);
+
+	if (full && !evtimer_pending(&c->holdev, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = BUFRETRY * 1000;
+		evtimer_add(&c->holdev, &tv);
+	}
+}
+
+static void
+retrycb(int fd, short ev, void *d)
+{
+	bev_throttle(d);
+}
+
+static void
+drainedcb(struct bufferevent *bev, void *d)
+{
+	struct conn *c = d;
+
+	if (c->paused)
+		bev_throttle(c);
+}
+
+/*
+ * Move what was read from bev to the output of to.  With libevent2 the
+ * chains of the input are handed over to the output, nothing is
+ * copied; libevent1 has to be told of the write.
+ */
+static void
+bev_move(struct conn *c, struct bufferevent *bev, struct bufferevent *to,
+    int in)
+{
+	struct evbuffer *buf = bufferevent_get_input(bev);
+
+	conn_account(c, evbuffer_get_length(buf), in);
+#ifdef LIBEVENT_VERSION_NUMBER
+	evbuffer_add_buffer(bufferevent_get_output(to), buf);
+#else
+	bufferevent_write_buffer(to, buf);
+#endif
+	bev_throttle(c);
 }
 
 static void
@@ -34,7 +139,7 @@ sreadcb(struct bufferevent *bev, void *d)
 {
 	struct conn *c = d;
 
-	bufferevent_write_buffer(c->tobev, EVBUFFER_INPUT(bev));
+	bev_move(c, bev, c->tobev, 1);
 }
 
 static void
@@ -42,7 +147,7 @@ treadcb(struct bufferevent *bev, void *d)
 {
 	struct conn *c = d;
 
-	bufferevent_write_buffer(c->sourcebev, EVBUFFER_INPUT(bev));
+	bev_move(c, bev, c->sourcebev, 0);
 }
 
 static void
@@ -54,20 +159,96 @@ errcb(struct bufferevent *bev, short event, void *d)
 	conn_free(c);
 }
 
-int
-conn_splice(struct conn *c)
+/*
+ * Reuse the bufferevent left over by a previous connection if
+ * possible.  libevent1 can't change the fd of a bufferevent, so
+ * there we always have to allocate a new one.
+ */
+static struct bufferevent *
+bev_get(struct bufferevent *bev, int fd, evbuffercb readcb, struct conn *c)
+{
+#ifdef LIBEVENT_VERSION_NUMBER
+	if (bev != NULL) {
+		if (bufferevent_setfd(bev, fd) == 0)
+			return bev;
+		bufferevent_free(bev);
+	}
+
+	if ((bev = bufferevent_socket_new(c->worker->base, fd, 0)) == NULL)
+		return NULL;
+	bufferevent_setcb(bev, readcb, drainedcb, errcb, c);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+	/* by default it moves at most 16k per syscall */
+	bufferevent_set_max_single_read(bev, BEV_IOSIZE);
+	bufferevent_set_max_single_write(bev, BEV_IOSIZE);
+#endif
+#else
+	if ((bev = bufferevent_new(fd, readcb, drainedcb, errcb, c)) == NULL)
+		return NULL;
+	bufferevent_base_set(c->worker->base, bev);
+#endif
+	return bev;
+}
+
+static void
+bev_put(struct bufferevent **bev)
+{
+#ifdef LIBEVENT_VERSION_NUMBER
+	struct evbuffer *buf;
+#endif
+
+	if (*bev == NULL)
+		return;
+
+#ifdef LIBEVENT_VERSION_NUMBER
+	bufferevent_disable(*bev, EV_READ|EV_WRITE);
+	bufferevent_setfd(*bev, -1);
+
+	buf = bufferevent_get_input(*bev);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	buf = bufferevent_get_output(*bev);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+#else
+	bufferevent_free(*bev);
+	*bev = NULL;
+#endif
+}
+
+static int
+bev_splice(struct conn *c)
 {
-	c->sourcebev = bufferevent_new(c->source, sreadcb, nopcb, errcb, c);
-	c->tobev = bufferevent_new(c->to, treadcb, nopcb, errcb, c);
+	evtimer_assign(&c->holdev, c->worker->base, retrycb, c);
+
+	c->sourcebev = bev_get(c->sourcebev, c->source, sreadcb, c);
+	c->tobev = bev_get(c->tobev, c->to, treadcb, c);
 
 	if (c->sourcebev == NULL || c->tobev == NULL) {
 		log_warn("bufferevent_new");
 		return -1;
 	}
 
+	/* drainedcb is called once the output is down to half */
+	bufferevent_setwatermark(c->sourcebev, EV_WRITE, bufmax / 2, 0);
+	bufferevent_setwatermark(c->tobev, EV_WRITE, bufmax / 2, 0);
+
 	bufferevent_enable(c->sourcebev, EV_READ|EV_WRITE);
 	bufferevent_enable(c->tobev, EV_READ|EV_WRITE);
 	return 0;
 }
 
-#endif	/* !HAVE_SO_SPLICE */
+static void
+bev_unsplice(struct conn *c)
+{
+	if (evtimer_pending(&c->holdev, NULL))
+		evtimer_del(&c->holdev);
+
+	if (c->held != 0)
+		bufmem_charge(-(long)c->held);
+
+	bev_put(&c->sourcebev);
+	bev_put(&c->tobev);
+}
+
+const struct backend backend_bev = {
+	"buffer", 1, bev_splice, bev_unsplice, NULL
+};
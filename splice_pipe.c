@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#if HAVE_SPLICE
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lstun.h"
+
+/* how much to move from the socket into the pipe in one go */
+#define PIPESIZ	(64 * 1024)
+
+#define SPLICE_FLAGS (SPLICE_F_MOVE|SPLICE_F_NONBLOCK)
+
+/*
+ * Move what's in the pipe to the other end.  If it can't take
+ * everything, stop reading and wait for it to become writable again.
+ */
+static int
+pipe_flush(struct pipedir *p)
+{
+	ssize_t n;
+
+	while (p->len > 0) {
+		n = splice(p->pfd[0], NULL, p->to, NULL, p->len,
+		    SPLICE_FLAGS);
+		if (n == -1) {
+			if (errno != EAGAIN)
+				return -1;
+			event_del(&p->rev);
+			event_add(&p->wev, NULL);
+			return 0;
+		}
+		p->len -= n;
+	}
+
+	if (!event_pending(&p->rev, EV_READ, NULL))
+		event_add(&p->rev, NULL);
+	return 0;
+}
+
+static void
+pipe_read(int fd, short ev, void *d)
+{
+	struct pipedir *p = d;
+	ssize_t n;
+
+	n = splice(p->from, NULL, p->pfd[1], NULL, PIPESIZ, SPLICE_FLAGS);
+	if (n == 0) {
+		log_info("closing connection (eof)");
+		conn_free(p->conn);
+		return;
+	}
+	if (n == -1) {
+		if (errno == EAGAIN)
+			return;
+		log_warn("splice");
+		conn_free(p->conn);
+		return;
+	}
+
+	p->len += n;
+	conn_account(p->conn, n, p == &p->conn->sdir);
+	if (pipe_flush(p) == -1) {
+		log_warn("splice");
+		conn_free(p->conn);
+	}
+}
+
+static void
+pipe_write(int fd, short ev, void *d)
+{
+	struct pipedir *p = d;
+
+	if (pipe_flush(p) == -1) {
+		log_warn("splice");
+		conn_free(p->conn);
+	}
+}
+
+static int
+pipedir_init(struct pipedir *p, struct conn *c, int from, int to)
+{
+	int flags;
+
+	if ((flags = fcntl(to, F_GETFL)) == -1 ||
+	    fcntl(to, F_SETFL, flags | O_NONBLOCK) == -1) {
+		log_warn("fcntl");
+		return -1;
+	}
+
+	/*
+	 * The pipe may be left over by a previous connection.  Since
+	 * fds 0-2 are always open, a zero pfd[0] means there's none.
+	 */
+	if (p->pfd[0] == 0 && pipe(p->pfd) == -1) {
+		log_warn("pipe");
+		p->pfd[0] = p->pfd[1] = 0;
+		return -1;
+	}
+
+	p->conn = c;
+	p->from = from;
+	p->to = to;
+	p->len = 0;
+
+	event_assign(&p->rev, c->worker->base, from, EV_READ|EV_PERSIST,
+	    pipe_read, p);
+	event_assign(&p->wev, c->worker->base, to, EV_WRITE, pipe_write,
+	    p);
+	event_add(&p->rev, NULL);
+	return 0;
+}
+
+static void
+pipedir_close(struct pipedir *p)
+{
+	if (p->conn == NULL)
+		return;
+
+	event_del(&p->rev);
+	event_del(&p->wev);
+	p->conn = NULL;
+
+	/* keep the pipe around for the next connection if it's empty */
+	if (p->len == 0)
+		return;
+
+	close(p->pfd[0]);
+	close(p->pfd[1]);
+	p->pfd[0] = p->pfd[1] = 0;
+}
+
+static int
+pipe_splice(struct conn *c)
+{
+	if (pipedir_init(&c->sdir, c, c->source, c->to) == -1 ||
+	    pipedir_init(&c->tdir, c, c->to, c->source) == -1)
+		return -1;
+	return 0;
+}
+
+static void
+pipe_unsplice(struct conn *c)
+{
+	pipedir_close(&c->sdir);
+	pipedir_close(&c->tdir);
+}
+
+const struct backend backend_pipe = {
+	"splice", 1, pipe_splice, pipe_unsplice, NULL
+};
+
+#endif	/* HAVE_SPLICE */
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Move the data with io_uring, talking to the kernel directly to
+ * avoid depending on liburing.
+ *
+ * Each worker has its own ring, created the first time it's needed.
+ * Every direction of a connection has a buffer and alternates between
+ * a recv from one side and the send(s) to the other of what was read.
+ * The requests are queued while the callbacks run and submitted all
+ * together at the end of the loop iteration, while libevent waits
+ * for completions by watching the ring fd, so a busy worker enters
+ * the kernel once for many connections instead of a few times for
+ * each of them.
+ *
+ * When the submission queue is full, because the kernel is slow to
+ * take the requests or to let us have the completions, the requests
+ * wait in order in the backlog of the ring until there's room again.
+ *
+ * The buffers count towards bufmemmax as soon as they're allocated:
+ * a connection that would go over it is closed.  Those of the closed
+ * connections are kept for the next ones, up to UFREEMAX per worker.
+ */
+
+#include "config.h"
+
+#if HAVE_IO_URING
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lstun.h"
+
+#define URING_ENTRIES	256
+#define URING_CQENTRIES	4096
+#define URING_BUFSIZ	(64 * 1024)
+#define UFREEMAX	16
+
+/* the requests of a udir */
+#define UREQ_RECV	1
+#define UREQ_SEND	2
+#define UREQ_CANCEL	3
+
+struct udir {
+	TAILQ_ENTRY(udir)	 entry;
+	struct uconn		*u;
+	int			 from;
+	int			 to;
+	int			 insource;	/* from the client */
+	int			 busy;		/* request in flight */
+	int			 wait;		/* in the backlog, or 0 */
+	size_t			 len;
+	size_t			 off;		/* already sent */
+	char			 buf[URING_BUFSIZ];
+};
+
+struct uconn {
+	SLIST_ENTRY(uconn)	 entry;
+	struct conn		*conn;		/* NULL once closed */
+	struct udir		 dir[2];
+};
+
+struct uring {
+	int			 fd;
+	unsigned int		*sqhead;
+	unsigned int		*sqtail;
+	unsigned int		 sqmask;
+	unsigned int		 sqentries;
+	unsigned int		*sqarray;
+	unsigned int		*sqflags;
+	struct io_uring_sqe	*sqes;
+	unsigned int		*cqhead;
+	unsigned int		*cqtail;
+	unsigned int		 cqmask;
+	struct io_uring_cqe	*cqes;
+	unsigned int		 queued;	/* not submitted yet */
+	int			 flushing;
+	struct event		 ev;
+	struct event		 flushev;
+	TAILQ_HEAD(, udir)	 backlog;	/* for the submission queue */
+	SLIST_HEAD(, uconn)	 free;		/* to reuse */
+	int			 nfree;
+};
+
+static void	uring_backlog(struct uring *);
+
+static int
+uring_enter(int fd, unsigned int n, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, n, 0, flags, NULL, 0);
+}
+
+static void
+uring_submit(struct uring *r)
+{
+	int n;
+
+	while (r->queued > 0) {
+		if ((n = uring_enter(r->fd, r->queued, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			/* EAGAIN or EBUSY: retry after the next completions */
+			if (errno != EAGAIN && errno != EBUSY)
+				log_warn("io_uring_enter");
+			return;
+		}
+		r->queued -= n;
+	}
+}
+
+static void
+uring_flush(int fd, short ev, void *d)
+{
+	struct uring *r = d;
+	struct timeval tv;
+
+	/* what the backlog queues goes now too */
+	for (;;) {
+		uring_submit(r);
+		if (r->queued > 0 || TAILQ_EMPTY(&r->backlog))
+			break;
+		uring_backlog(r);
+	}
+	r->flushing = 0;
+
+	/* in case there's nothing in flight to wake us up */
+	if (r->queued > 0) {
+		r->flushing = 1;
+		tv.tv_sec = 0;
+		tv.tv_usec = 1000;
+		evtimer_add(&r->flushev, &tv);
+	}
+}
+
+/*
+ * Get a submission queue entry, or NULL if it's still full after
+ * submitting what's there.
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring *r, int op, int fd, void *data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail;
+
+	tail = *r->sqtail;
+	head = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+	if (tail - head == r->sqentries) {
+		uring_submit(r);
+		head = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+		if (tail - head == r->sqentries)
+			return NULL;
+	}
+
+	sqe = &r->sqes[tail & r->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = (unsigned long)data;
+
+	r->sqarray[tail & r->sqmask] = tail & r->sqmask;
+	__atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+
+	/* submit everything at the end of this loop iteration */
+	if (!r->flushing) {
+		r->flushing = 1;
+		event_active(&r->flushev, EV_TIMEOUT, 1);
+	}
+	return sqe;
+}
+
+/*
+ * Queue the request req of d.  Returns -1 if there's no room.
+ */
+static int
+udir_queue(struct uring *r, struct udir *d, int req)
+{
+	struct io_uring_sqe *sqe = NULL;
+
+	switch (req) {
+	case UREQ_RECV:
+		sqe = uring_sqe(r, IORING_OP_RECV, d->from, d);
+		break;
+	case UREQ_SEND:
+		sqe = uring_sqe(r, IORING_OP_SEND, d->to, d);
+		break;
+	case UREQ_CANCEL:
+		sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL);
+		break;
+	}
+	if (sqe == NULL)
+		return -1;
+
+	switch (req) {
+	case UREQ_RECV:
+		sqe->addr = (unsigned long)d->buf;
+		sqe->len = sizeof(d->buf);
+		d->busy = 1;
+		break;
+	case UREQ_SEND:
+		sqe->addr = (unsigned long)(d->buf + d->off);
+		sqe->len = d->len - d->off;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		d->busy = 1;
+		break;
+	case UREQ_CANCEL:
+		sqe->addr = (unsigned long)d;
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Issue the request req of d, or put it in the backlog if the
+ * submission queue is full or others are waiting already.
+ */
+static void
+udir_issue(struct uring *r, struct udir *d, int req)
+{
+	if (TAILQ_EMPTY(&r->backlog) && udir_queue(r, d, req) == 0)
+		return;
+	d->wait = req;
+	TAILQ_INSERT_TAIL(&r->backlog, d, entry);
+}
+
+static void
+udir_unwait(struct uring *r, struct udir *d)
+{
+	if (d->wait == 0)
+		return;
+	TAILQ_REMOVE(&r->backlog, d, entry);
+	d->wait = 0;
+}
+
+/*
+ * Issue the requests of the backlog while there's room.
+ */
+static void
+uring_backlog(struct uring *r)
+{
+	struct udir *d;
+
+	while ((d = TAILQ_FIRST(&r->backlog)) != NULL) {
+		if (udir_queue(r, d, d->wait) == -1)
+			break;
+		udir_unwait(r, d);
+	}
+}
+
+/*
+ * u is idle: keep it for the next connection or release its memory.
+ */
+static void
+uconn_put(struct uring *r, struct uconn *u)
+{
+	if (r->nfree < UFREEMAX) {
+		SLIST_INSERT_HEAD(&r->free, u, entry);
+		r->nfree++;
+		return;
+	}
+	free(u);
+	bufmem_charge(-(long)sizeof(*u));
+}
+
+static void
+udir_done(struct uring *r, struct udir *d, int res)
+{
+	struct uconn *u = d->u;
+	struct conn *c = u->conn;
+
+	d->busy = 0;
+
+	if (c == NULL) {
+		/* the connection is gone, recycle once both are idle */
+		udir_unwait(r, d);
+		if (!u->dir[0].busy && !u->dir[1].busy)
+			uconn_put(r, u);
+		return;
+	}
+
+	if (res <= 0) {
+		if (res == 0)
+			log_info("closing connection (eof)");
+		else {
+			errno = -res;
+			log_warn("closing connection");
+		}
+		conn_free(c);
+		return;
+	}
+
+	if (d->len == 0) {
+		conn_account(c, res, d->insource);
+		d->len = res;
+		d->off = 0;
+	} else
+		d->off += res;
+
+	if (d->off < d->len)
+		udir_issue(r, d, UREQ_SEND);
+	else {
+		d->len = 0;
+		udir_issue(r, d, UREQ_RECV);
+	}
+}
+
+static void
+uring_reap(int fd, short ev, void *arg)
+{
+	struct uring *r = arg;
+	struct io_uring_cqe *cqe;
+	struct udir *d;
+	unsigned int head, tail;
+	int res;
+
+	head = *r->cqhead;
+	for (;;) {
+		tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+		for (; head != tail; head++) {
+			cqe = &r->cqes[head & r->cqmask];
+			d = (struct udir *)cqe->user_data;
+			res = cqe->res;
+
+			/* give the entry back before handling it */
+			__atomic_store_n(r->cqhead, head + 1,
+			    __ATOMIC_RELEASE);
+			if (d != NULL)
+				udir_done(r, d, res);
+		}
+
+		/*
+		 * The completions that didn't fit are kept aside by
+		 * the kernel until we ask for them.
+		 */
+		if (__atomic_load_n(r->sqflags, __ATOMIC_ACQUIRE) &
+		    IORING_SQ_CQ_OVERFLOW)
+			uring_enter(r->fd, 0, IORING_ENTER_GETEVENTS);
+	}
+
+	uring_submit(r);
+	uring_backlog(r);
+}
+
+static int
+uring_setup(struct io_uring_params *p)
+{
+	memset(p, 0, sizeof(*p));
+
+	/* every connection may have two requests and two cancels */
+	p->flags = IORING_SETUP_CQSIZE;
+	p->cq_entries = URING_CQENTRIES;
+	return syscall(__NR_io_uring_setup, URING_ENTRIES, p);
+}
+
+static struct uring *
+uring_new(struct worker *w)
+{
+	struct io_uring_params p;
+	struct uring *r;
+	size_t sqlen, cqlen;
+	char *sq, *cq;
+	void *sqes;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return NULL;
+	TAILQ_INIT(&r->backlog);
+	SLIST_INIT(&r->free);
+
+	if ((r->fd = uring_setup(&p)) == -1) {
+		free(r);
+		return NULL;
+	}
+
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cqlen > sqlen)
+		sqlen = cqlen;
+
+	/* FEAT_SINGLE_MMAP, checked by uring_available */
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	    r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	cq = sq;
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+	    IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto err;
+
+	r->sqhead = (unsigned int *)(sq + p.sq_off.head);
+	r->sqtail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sqmask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sqentries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+	r->sqarray = (unsigned int *)(sq + p.sq_off.array);
+	r->sqflags = (unsigned int *)(sq + p.sq_off.flags);
+	r->sqes = sqes;
+	r->cqhead = (unsigned int *)(cq + p.cq_off.head);
+	r->cqtail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cqmask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* the ring fd becomes readable when there are completions */
+	event_assign(&r->ev, w->base, r->fd, EV_READ|EV_PERSIST, uring_reap,
+	    r);
+	event_add(&r->ev, NULL);
+
+	evtimer_assign(&r->flushev, w->base, uring_flush, r);
+
+	return r;
+
+ err:
+	log_warn("mmap");
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+static int
+uring_available(void)
+{
+	struct io_uring_params p;
+	unsigned int need;
+	int fd;
+
+	/*
+	 * FAST_POLL is needed to wait for the sockets without
+	 * blocking a kernel thread per request, and arrived after
+	 * IORING_OP_RECV and IORING_OP_SEND.
+	 */
+	need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+	    IORING_FEAT_FAST_POLL;
+
+	if ((fd = uring_setup(&p)) == -1)
+		return 0;
+	close(fd);
+	return (p.features & need) == need;
+}
+
+static int
+uring_splice(struct conn *c)
+{
+	struct worker *w = c->worker;
+	struct uconn *u;
+	int i;
+
+	if (w->uring == NULL && (w->uring = uring_new(w)) == NULL) {
+		log_warn("io_uring");
+		return -1;
+	}
+
+	if ((u = SLIST_FIRST(&w->uring->free)) != NULL) {
+		SLIST_REMOVE_HEAD(&w->uring->free, entry);
+		w->uring->nfree--;
+	} else {
+		if (bufmem_charge(sizeof(*u)) > bufmemmax && bufmemmax != 0) {
+			bufmem_charge(-(long)sizeof(*u));
+			log_warnx("out of buffer memory");
+			return -1;
+		}
+		if ((u = malloc(sizeof(*u))) == NULL) {
+			log_warn("malloc");
+			bufmem_charge(-(long)sizeof(*u));
+			return -1;
+		}
+	}
+
+	u->conn = c;
+	u->dir[0].from = c->source;
+	u->dir[0].to = c->to;
+	u->dir[0].insource = 1;
+	u->dir[1].from = c->to;
+	u->dir[1].to = c->source;
+	u->dir[1].insource = 0;
+	for (i = 0; i < 2; ++i) {
+		u->dir[i].u = u;
+		u->dir[i].len = 0;
+		u->dir[i].wait = 0;
+		udir_issue(w->uring, &u->dir[i], UREQ_RECV);
+	}
+
+	c->uconn = u;
+	return 0;
+}
+
+static void
+uring_unsplice(struct conn *c)
+{
+	struct uring *r = c->worker->uring;
+	struct uconn *u = c->uconn;
+	int i;
+
+	if (u == NULL)
+		return;
+
+	/*
+	 * The kernel may still be using the buffers: keep them around
+	 * until all the requests, cancelled here, have completed.
+	 */
+	u->conn = NULL;
+	udir_unwait(r, &u->dir[0]);
+	udir_unwait(r, &u->dir[1]);
+	if (!u->dir[0].busy && !u->dir[1].busy) {
+		uconn_put(r, u);
+		return;
+	}
+	for (i = 0; i < 2; ++i)
+		if (u->dir[i].busy)
+			udir_issue(r, &u->dir[i], UREQ_CANCEL);
+
+	/* before the fds are closed and maybe reused by another conn */
+	uring_submit(r);
+}
+
+const struct backend backend_uring = {
+	"uring", 1, uring_splice, uring_unsplice, uring_available
+};
+
+#endif	/* HAVE_IO_URING */
@@ -1,3 +1,28 @@
+#if TEST_ACCEPT4
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <stddef.h>
+
+int
+main(void)
+{
+	/*
+	 * invalid usage, i'm only interested in checking if it
+	 * compiles
+	 */
+	return accept4(0, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC) != -1;
+}
+#endif /* TEST_ACCEPT4 */
+#if TEST_CLOSEFROM
+#include <unistd.h>
+
+int
+main(void)
+{
+	closefrom(3);
+	return 0;
+}
+#endif /* TEST_CLOSEFROM */
 #if TEST_GETEXECNAME
 #include <stdlib.h>
 
@@ -22,6 +47,27 @@ main(void)
 	return progname == NULL;
 }
 #endif /* TEST_GETPROGNAME */
+#if TEST_IO_URING
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <unistd.h>
+
+int
+main(void)
+{
+	struct io_uring_params p = { 0 };
+
+	/*
+	 * invalid usage, i'm only interested in checking if it
+	 * compiles
+	 */
+	syscall(__NR_io_uring_setup, 0, &p);
+	syscall(__NR_io_uring_enter, -1, 0, 0, 0, NULL, 0);
+	return IORING_OP_RECV + IORING_OP_SEND + IORING_FEAT_FAST_POLL;
+}
+#endif /* TEST_IO_URING */
 #if TEST_LIBEVENT
 #include <event.h>
 
@@ -69,6 +115,23 @@ main(void)
 	return c == -1;
 }
 #endif /* TEST_LIB_SOCKET */
+#if TEST_PIDFD
+#include <sys/syscall.h>
+
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+
+int
+main(void)
+{
+	int fd;
+
+	if ((fd = syscall(__NR_pidfd_open, getpid(), 0)) == -1)
+		return 1;
+	return syscall(__NR_pidfd_send_signal, fd, 0, NULL, 0) == -1;
+}
+#endif /* TEST_PIDFD */
 #if TEST_PLEDGE
 #include <unistd.h>
 
@@ -99,6 +162,27 @@ main(void)
 	return 0;
 }
 #endif /* TEST_PR_SET_NAME */
+#if TEST_PTHREAD
+#include <pthread.h>
+#include <stddef.h>
+
+static void *
+start(void *arg)
+{
+	return arg;
+}
+
+int
+main(void)
+{
+	pthread_t tid;
+	void *ret;
+
+	if (pthread_create(&tid, NULL, start, NULL) != 0)
+		return 1;
+	return pthread_join(tid, &ret) != 0;
+}
+#endif /* TEST_PTHREAD */
 #if TEST_SO_SPLICE
 #include <sys/socket.h>
 
@@ -115,6 +199,22 @@ main(void)
 	return 0;
 }
 #endif /* TEST_SO_SPLICE */
+#if TEST_SPLICE
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stddef.h>
+
+int
+main(void)
+{
+	/*
+	 * invalid usage, i'm only interested in checking if it
+	 * compiles
+	 */
+	splice(0, NULL, 1, NULL, 1, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	return 0;
+}
+#endif /* TEST_SPLICE */
 #if TEST_STATIC
 int
 main(void)